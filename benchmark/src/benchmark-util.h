@@ -0,0 +1,39 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string_view>
+
+namespace keyboard_auto_type::benchmark {
+
+// Prevents the compiler from throwing away a value computed by the benchmark
+template <typename T> inline void keep(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory"); // NOLINT(hicpp-no-assembler)
+#else
+    static volatile const void *sink = nullptr;
+    sink = &value;
+#endif
+}
+
+// Runs fn the given number of times and prints the average time of one item,
+// fn processes items_per_call items, for example characters of a string
+template <typename Fn>
+double measure(std::string_view name, size_t iterations, Fn fn, size_t items_per_call = 1) {
+    fn(); // warm up caches
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        fn();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    auto ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+              static_cast<double>(iterations * items_per_call);
+    std::printf("%-48.*s %12.2f ns\n", static_cast<int>(name.size()), name.data(), ns);
+    return ns;
+}
+
+void run_keysym_table_benchmarks();
+void run_keysym_map_benchmarks();
+void run_layout_load_benchmarks();
+
+} // namespace keyboard_auto_type::benchmark
@@ -0,0 +1,73 @@
+#include <string>
+#include <vector>
+
+#include "benchmark-util.h"
+#include "linux/x11-keysym-map.h"
+
+namespace keyboard_auto_type::benchmark {
+
+namespace {
+
+constexpr size_t TEXT_LENGTH = 4096;
+constexpr size_t ITERATIONS = 2000;
+
+std::u32string make_text(char32_t first, char32_t count) {
+    std::u32string text;
+    for (size_t i = 0; i < TEXT_LENGTH; i++) {
+        text.push_back(first + static_cast<char32_t>(i % count));
+    }
+    return text;
+}
+
+// Latin text with a non-Latin-1 character in every sentence
+std::u32string make_mixed_text() {
+    constexpr auto SENTENCE_LENGTH = 40;
+    auto text = make_text(U' ', 0x5f);
+    for (size_t i = SENTENCE_LENGTH; i < text.size(); i += SENTENCE_LENGTH) {
+        text[i] = U'€';
+    }
+    return text;
+}
+
+template <typename Convert>
+void measure_conversion(const std::string &name, const std::u32string &text, Convert convert) {
+    std::vector<uint32_t> key_syms(text.size());
+    measure(
+        name, ITERATIONS,
+        [&] {
+            convert(text, key_syms.data());
+            keep(key_syms.data());
+        },
+        text.size());
+}
+
+void measure_text(std::string_view name, const std::u32string &text) {
+    measure_conversion(std::string(name) + ": char_to_keysym", text,
+                       [](std::u32string_view chars, uint32_t *key_syms) {
+                           for (auto ch : chars) {
+                               *key_syms++ = char_to_keysym(ch);
+                           }
+                       });
+    measure_conversion(std::string(name) + ": scalar", text, chars_to_keysyms_scalar);
+#if KEYBOARD_AUTO_TYPE_X86_SIMD
+    measure_conversion(std::string(name) + ": SSE2", text, chars_to_keysyms_sse2);
+    if (cpu_supports_avx2()) {
+        measure_conversion(std::string(name) + ": AVX2", text, chars_to_keysyms_avx2);
+    }
+#endif
+    measure_conversion(std::string(name) + ": chars_to_keysyms", text, chars_to_keysyms);
+}
+
+} // namespace
+
+void run_keysym_map_benchmarks() {
+    std::printf("Characters to key syms: %zu characters, time per character\n", TEXT_LENGTH);
+
+    measure_text("ASCII", make_text(U' ', 0x5f));
+    measure_text("Latin-1", make_text(U'\xa0', 0x60));
+    measure_text("Mixed", make_mixed_text());
+    measure_text("Cyrillic", make_text(U'А', 0x40));
+    measure_text("CJK (no key syms)", make_text(U'一', 0x1000));
+}
+
+} // namespace keyboard_auto_type::benchmark
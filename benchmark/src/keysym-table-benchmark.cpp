@@ -0,0 +1,108 @@
+#include <unordered_map>
+#include <vector>
+
+#include "benchmark-util.h"
+#include "linux/x11-keysym-table.h"
+
+namespace keyboard_auto_type::benchmark {
+
+namespace {
+
+constexpr size_t REBUILD_ITERATIONS = 20000;
+constexpr size_t LOOKUP_ITERATIONS = 2000;
+
+// Key syms found in a typical two-group layout (English and Russian)
+std::vector<KeySym> layout_key_syms() {
+    std::vector<KeySym> key_syms;
+    for (KeySym key_sym = 0x20; key_sym <= 0x7e; key_sym++) {
+        key_syms.push_back(key_sym); // ASCII
+    }
+    for (KeySym key_sym = 0x6a3; key_sym <= 0x6ff; key_sym++) {
+        key_syms.push_back(key_sym); // Cyrillic
+    }
+    for (KeySym key_sym = 0xfe50; key_sym <= 0xfe60; key_sym++) {
+        key_syms.push_back(key_sym); // dead keys
+    }
+    for (KeySym key_sym = 0xff08; key_sym <= 0xffff; key_sym += 3) {
+        key_syms.push_back(key_sym); // function keys, keypad, modifiers
+    }
+    for (KeySym key_sym = 0x1008ff01; key_sym <= 0x1008ffb0; key_sym++) {
+        key_syms.push_back(key_sym); // XF86 media keys
+    }
+    return key_syms;
+}
+
+KeyCodeWithMask key_for(size_t index) {
+    KeyCodeWithMask key{};
+    key.key_code = static_cast<uint8_t>(8 + index % 248);
+    key.group = static_cast<uint8_t>(index % 2);
+    key.mod_mask = index % 3 ? ShiftMask : 0;
+    return key;
+}
+
+// Mostly Latin text with some Cyrillic and characters missing in the layout
+std::vector<KeySym> typed_key_syms() {
+    std::vector<KeySym> key_syms;
+    for (auto i = 0; i < 1000; i++) {
+        if (i % 10 == 0) {
+            key_syms.push_back(0x6c0 + i % 32);
+        } else if (i % 37 == 0) {
+            key_syms.push_back(0x1000000 + 0x4e00 + i); // Unicode key sym, not found
+        } else {
+            key_syms.push_back(0x61 + i % 26);
+        }
+    }
+    return key_syms;
+}
+
+} // namespace
+
+void run_keysym_table_benchmarks() {
+    auto layout = layout_key_syms();
+    auto text = typed_key_syms();
+
+    std::printf("Key sym table: %zu key syms in the layout, time per rebuild or %zu lookups\n",
+                layout.size(), text.size());
+
+    std::unordered_map<KeySym, KeyCodeWithMask> map;
+    measure("rebuild: std::unordered_map", REBUILD_ITERATIONS, [&] {
+        map.clear();
+        for (size_t i = 0; i < layout.size(); i++) {
+            map.insert_or_assign(layout[i], key_for(i));
+        }
+        keep(map.size());
+    });
+
+    X11KeySymTable table;
+    measure("rebuild: X11KeySymTable", REBUILD_ITERATIONS, [&] {
+        table.clear();
+        table.reserve(256);
+        for (size_t i = 0; i < layout.size(); i++) {
+            table.insert_or_assign(layout[i], key_for(i));
+        }
+        keep(table.size());
+    });
+
+    measure("lookup text: std::unordered_map", LOOKUP_ITERATIONS, [&] {
+        unsigned found = 0;
+        for (auto key_sym : text) {
+            auto it = map.find(key_sym);
+            if (it != map.end()) {
+                found += it->second.key_code;
+            }
+        }
+        keep(found);
+    });
+
+    measure("lookup text: X11KeySymTable", LOOKUP_ITERATIONS, [&] {
+        unsigned found = 0;
+        for (auto key_sym : text) {
+            if (const auto *key = table.find(key_sym)) {
+                found += key->key_code;
+            }
+        }
+        keep(found);
+    });
+}
+
+} // namespace keyboard_auto_type::benchmark
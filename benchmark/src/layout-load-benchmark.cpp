@@ -0,0 +1,137 @@
+#include <X11/XKBlib.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include "benchmark-util.h"
+#include "linux/x11-keyboard-layout.h"
+#include "linux/x11-layout-snapshot.h"
+
+namespace keyboard_auto_type::benchmark {
+
+namespace {
+
+constexpr size_t LOAD_ITERATIONS = 50;
+
+// Bytes received from the X server while fn is running
+template <typename Fn> uint64_t bytes_received(Display *display, Fn fn) {
+    auto *connection = XGetXCBConnection(display);
+    auto before = xcb_total_read(connection);
+    fn();
+    return xcb_total_read(connection) - before;
+}
+
+void print_bytes(const char *name, uint64_t bytes) {
+    std::printf("%-48s %12" PRIu64 " B\n", name, bytes);
+}
+
+// How the keymap was fetched before: XkbGetKeyboard takes component masks as "get by name"
+// masks, so this fetches client symbols and key names through GetKbdByName
+XkbDescHandle get_full_keyboard(Display *display) {
+    return XkbDescHandle(
+        XkbGetKeyboard(display, XkbCompatMapMask | XkbGeometryMask, XkbUseCoreKbd));
+}
+
+// Snapshots of the user are not touched, layouts are read and saved in a temporary cache directory
+std::string use_temp_cache_dir() {
+    std::string dir = (std::filesystem::temp_directory_path() / "kbd-auto-type-XXXXXX").string();
+    if (!mkdtemp(dir.data())) {
+        return {};
+    }
+    setenv("XDG_CACHE_HOME", dir.c_str(), 1); // NOLINT(concurrency-mt-unsafe)
+    return dir;
+}
+
+} // namespace
+
+void run_layout_load_benchmarks() {
+    auto *display = XOpenDisplay(nullptr);
+    if (!display) {
+        std::printf("Keyboard layout load: skipped, no X display\n");
+        return;
+    }
+    if (!x11_get_key_sym_map(display)) {
+        std::printf("Keyboard layout load: skipped, XKB is not available\n");
+        XCloseDisplay(display);
+        return;
+    }
+    X11ReservedKeys reserved_keys;
+    int active_group = 0;
+    XkbStateRec kbd_state{};
+    if (XkbGetState(display, XkbUseCoreKbd, &kbd_state) == Success) {
+        active_group = kbd_state.group;
+    }
+
+    std::printf("Keyboard layout load: bytes received and time per load\n");
+
+    print_bytes("fetch: XkbGetKeyboard (before)", bytes_received(display, [&] {
+                    keep(get_full_keyboard(display).get());
+                }));
+    print_bytes("fetch: key types and key syms (after)", bytes_received(display, [&] {
+                    keep(x11_get_key_sym_map(display).get());
+                }));
+
+    measure("fetch: XkbGetKeyboard (before)", LOAD_ITERATIONS,
+            [&] { keep(get_full_keyboard(display).get()); });
+    measure("fetch: key types and key syms (after)", LOAD_ITERATIONS,
+            [&] { keep(x11_get_key_sym_map(display).get()); });
+
+    measure("load: XkbGetKeyboard, all groups (before)", LOAD_ITERATIONS, [&] {
+        auto layout = x11_build_keyboard_layout(get_full_keyboard(display),
+                                                static_cast<uint8_t>(active_group), reserved_keys);
+        keep(layout->inactive_group_keys.keys().size());
+    });
+    measure("load: key sym map, active group (after)", LOAD_ITERATIONS, [&] {
+        auto layout = x11_build_keyboard_layout(x11_get_key_sym_map(display),
+                                                static_cast<uint8_t>(active_group), reserved_keys);
+        keep(layout->keys.size());
+    });
+    measure("load: key sym map, other groups used (after)", LOAD_ITERATIONS, [&] {
+        auto layout = x11_build_keyboard_layout(x11_get_key_sym_map(display),
+                                                static_cast<uint8_t>(active_group), reserved_keys);
+        keep(layout->inactive_group_keys.keys().size());
+    });
+
+    auto cache_dir = use_temp_cache_dir();
+    if (!cache_dir.empty()) {
+        // everything the typing thread does on the first keystroke: fetch, hash, build
+        measure("read: x11_read_keyboard_layout, no snapshot", LOAD_ITERATIONS, [&] {
+            auto layout = x11_read_keyboard_layout(display, static_cast<uint8_t>(active_group),
+                                                   reserved_keys);
+            keep(layout->keys.size());
+        });
+
+        auto saved_layout = x11_read_keyboard_layout(
+            display, static_cast<uint8_t>(active_group), reserved_keys);
+        x11_save_layout_snapshot(*saved_layout);
+        // keymap names and a mapped file, the key sym map is not fetched
+        measure("read: x11_read_keyboard_layout, snapshot hit", LOAD_ITERATIONS, [&] {
+            auto layout = x11_read_keyboard_layout(display, static_cast<uint8_t>(active_group),
+                                                   reserved_keys);
+            keep(layout->keys.size());
+        });
+        // the worst case, usually only the keys of the typed characters are checked
+        auto min_key_code = 0;
+        auto max_key_code = 0;
+        XDisplayKeycodes(display, &min_key_code, &max_key_code);
+        measure("check: x11_check_snapshot_keys, all keys", LOAD_ITERATIONS, [&] {
+            auto layout = x11_read_keyboard_layout(display, static_cast<uint8_t>(active_group),
+                                                   reserved_keys);
+            if (layout->snapshot) {
+                keep(x11_check_snapshot_keys(display, *layout->snapshot,
+                                             static_cast<uint8_t>(min_key_code),
+                                             static_cast<uint8_t>(max_key_code), reserved_keys));
+            }
+        });
+        std::filesystem::remove_all(cache_dir);
+    }
+
+    XCloseDisplay(display);
+}
+
+} // namespace keyboard_auto_type::benchmark
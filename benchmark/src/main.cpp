@@ -0,0 +1,9 @@
+#include "benchmark-util.h"
+
+int main() {
+#if __linux__
+    keyboard_auto_type::benchmark::run_keysym_table_benchmarks();
+    keyboard_auto_type::benchmark::run_keysym_map_benchmarks();
+    keyboard_auto_type::benchmark::run_layout_load_benchmarks();
+#endif
+}
@@ -0,0 +1,84 @@
+#ifndef KEYBOARD_AUTO_TYPE_ASYNC_H
+#define KEYBOARD_AUTO_TYPE_ASYNC_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "keyboard-auto-type.h"
+
+namespace keyboard_auto_type {
+
+// Runs AutoType on a dedicated worker thread, jobs are executed one by one in the order
+// they were submitted, submitting a job never blocks the caller
+class AsyncAutoType {
+  public:
+    using Job = std::function<AutoTypeResult(AutoType &typer)>;
+    using Callback = std::function<void(AutoTypeResult result, std::exception_ptr error)>;
+
+  private:
+    struct JobNode {
+        std::atomic<JobNode *> next = nullptr;
+        uint64_t id = 0;
+        Job job;
+        std::promise<AutoTypeResult> promise;
+        Callback callback;
+    };
+
+    // lock-free multi-producer single-consumer queue,
+    // producers append to head_, the worker takes from tail_
+    std::atomic<JobNode *> head_;
+    JobNode *tail_;
+
+    std::atomic<bool> worker_waiting_ = false;
+    std::atomic<bool> stopping_ = false;
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    // jobs with id up to cancelled_job_id_ are cancelled
+    std::atomic<uint64_t> last_job_id_ = 0;
+    uint64_t cancelled_job_id_ = 0;
+    uint64_t running_job_id_ = 0;
+    std::mutex cancel_mutex_;
+    CancellationToken cancellation_token_;
+    std::atomic<bool> hot_ = false;
+
+    std::thread worker_;
+
+    void push(JobNode *node);
+    JobNode *pop();
+    void run_worker();
+    void run_job(AutoType &typer, JobNode &node);
+
+  public:
+    AsyncAutoType();
+    ~AsyncAutoType();
+
+    AsyncAutoType(const AsyncAutoType &) = delete;
+    AsyncAutoType &operator=(const AsyncAutoType &) = delete;
+    AsyncAutoType(AsyncAutoType &&) = delete;
+    AsyncAutoType &operator=(AsyncAutoType &&) = delete;
+
+    std::future<AutoTypeResult> submit(Job job);
+    void submit(Job job, Callback callback);
+
+    std::future<AutoTypeResult> text(std::u32string str);
+    std::future<AutoTypeResult> text(std::string utf8_str);
+    // the reader is called on the worker thread
+    std::future<AutoTypeResult> text(TextChunkReader reader);
+    std::future<AutoTypeResult> key_press(KeyCode code, Modifier modifier = Modifier::None);
+    std::future<AutoTypeResult> shortcut(KeyCode code);
+    // warms up the worker's AutoType without blocking the caller, for example, at startup
+    std::future<AutoTypeResult> warm_up(ActiveWindowArgs args = {});
+    [[nodiscard]] bool is_hot() const;
+
+    void cancel();
+};
+
+} // namespace keyboard_auto_type
+
+#endif
@@ -1,11 +1,15 @@
 #ifndef KEYBOARD_AUTO_TYPE_H
 #define KEYBOARD_AUTO_TYPE_H
 
+#include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <functional>
+#include <iosfwd>
+#include <iterator>
 #include <memory>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -72,6 +76,19 @@ enum class AutoTypeResult {
     KeyPressFailed,
     NotSupported,
     OsError,
+    LayoutChanged,
+    Cancelled,
+};
+
+// Thrown instead of returning an error result, BadArg is thrown as std::invalid_argument
+class AutoTypeError : public std::runtime_error {
+  private:
+    AutoTypeResult result_;
+
+  public:
+    AutoTypeError(AutoTypeResult result, const std::string &message);
+
+    [[nodiscard]] AutoTypeResult result() const noexcept;
 };
 
 struct AppWindow {
@@ -92,6 +109,94 @@ struct KeyCodeWithModifiers {
     Modifier modifier;
 };
 
+// std::optional<KeyCodeWithModifiers> packed to 4 bytes:
+// 25 bits of the key code, 6 bits of the modifier, and a bit telling that there's a key code
+class PackedKeyCode {
+  private:
+    static constexpr uint32_t CODE_MASK = 0x01FF'FFFF;
+    static constexpr uint32_t MODIFIER_SHIFT = 25;
+    static constexpr uint32_t MODIFIER_MASK = 0x3F;
+    static constexpr uint32_t HAS_VALUE_BIT = 0x8000'0000;
+
+    uint32_t value_ = 0;
+
+  public:
+    constexpr PackedKeyCode() = default;
+    constexpr explicit PackedKeyCode(KeyCodeWithModifiers key)
+        : value_(HAS_VALUE_BIT | (static_cast<uint32_t>(key.code) & CODE_MASK) |
+                 (static_cast<uint32_t>(key.modifier) & MODIFIER_MASK) << MODIFIER_SHIFT) {}
+    constexpr explicit PackedKeyCode(const std::optional<KeyCodeWithModifiers> &key)
+        : PackedKeyCode(key.has_value() ? PackedKeyCode(*key) : PackedKeyCode()) {}
+
+    [[nodiscard]] constexpr bool has_value() const { return value_ & HAS_VALUE_BIT; }
+    [[nodiscard]] constexpr os_key_code_t code() const {
+        return static_cast<os_key_code_t>(value_ & CODE_MASK);
+    }
+    [[nodiscard]] constexpr Modifier modifier() const {
+        return static_cast<Modifier>((value_ >> MODIFIER_SHIFT) & MODIFIER_MASK);
+    }
+    [[nodiscard]] constexpr std::optional<KeyCodeWithModifiers> unpack() const {
+        if (!has_value()) {
+            return std::nullopt;
+        }
+        return KeyCodeWithModifiers{code(), modifier()};
+    }
+};
+
+struct AutoTypeStats {
+    size_t chars_sent = 0;
+    size_t round_trips_saved = 0;
+    // keyboard group and locked modifiers changes made to type characters from other groups
+    size_t state_changes = 0;
+    // time spent waiting for apps to apply a temporary key mapping
+    std::chrono::microseconds key_mapping_wait_time{};
+};
+
+// Shared cancellation flag, copies refer to the same flag
+class CancellationToken {
+  private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+
+  public:
+    CancellationToken();
+
+    void cancel() const noexcept;
+    void reset() const noexcept;
+    [[nodiscard]] bool is_cancelled() const noexcept;
+};
+
+class TextReader;
+class TextPipeline;
+
+// Fills the buffer with up to size characters of the text and returns the number of characters
+// written, 0 means the end of the text, it can be called on a background thread
+using TextChunkReader = std::function<size_t(char32_t *buffer, size_t size)>;
+
+struct TypingProgramEvent {
+    Direction direction = Direction::Down;
+    Modifier modifier = Modifier::None;
+    char32_t character = 0;
+    std::optional<os_key_code_t> code;
+    // key resolved by the backend at compile time, 0 if it must be resolved when typing
+    uint32_t native_key = 0;
+};
+
+class TypingProgram {
+  private:
+    std::vector<TypingProgramEvent> events_;
+    size_t length_ = 0;
+    uint64_t layout_generation_ = 0;
+    // keys missing in the layout, they are mapped by the backend before running
+    std::vector<PackedKeyCode> unresolved_keys_;
+
+    friend class AutoType;
+
+  public:
+    [[nodiscard]] const std::vector<TypingProgramEvent> &events() const;
+    [[nodiscard]] size_t length() const;
+    [[nodiscard]] uint64_t layout_generation() const;
+};
+
 class AutoTypeTextTransaction {
   private:
     std::function<void()> end_callback_;
@@ -112,6 +217,8 @@ class AutoType {
     static constexpr auto DEFAULT_UNPRESS_MODIFIERS_TOTAL_WAIT_TIME =
         std::chrono::milliseconds(10'000);
     static constexpr auto KEY_HOLD_LOOP_WAIT_TIME = std::chrono::milliseconds(100);
+    // bigger buffers are freed after use, not to keep the memory taken by a huge text
+    static constexpr size_t MAX_RETAINED_KEY_CODES = 64 * 1024;
 
     class AutoTypeImpl;
     std::unique_ptr<AutoTypeImpl> impl_;
@@ -120,6 +227,38 @@ class AutoType {
     std::chrono::milliseconds unpress_modifiers_total_wait_time_ =
         DEFAULT_UNPRESS_MODIFIERS_TOTAL_WAIT_TIME;
     bool check_pressed_modifiers_ = true;
+    AutoTypeStats stats_{};
+    std::optional<CancellationToken> cancellation_token_;
+    // reused by text() and compile(), so that typing doesn't allocate memory for each call
+    std::vector<PackedKeyCode> key_codes_buffer_;
+    // started by the first long text and kept, so that next texts don't start a thread
+    std::unique_ptr<TextPipeline> text_pipeline_;
+    std::atomic<bool> hot_ = false;
+
+    [[nodiscard]] bool is_cancelled() const;
+    AutoTypeResult cancelled_result();
+    // returns Cancelled once the keys released by release_result have been sent,
+    // a failure to release them is reported instead
+    AutoTypeResult release_and_cancel(AutoTypeResult release_result);
+    void wait_for_modifiers_change(std::chrono::milliseconds timeout);
+
+    uint64_t keyboard_layout_generation();
+    uint32_t native_key(os_key_code_t code);
+    AutoTypeResult key_move(const TypingProgramEvent &event);
+    AutoTypeResult map_missing_keys(const PackedKeyCode *keys, size_t keys_size);
+    // resolves key codes on another thread while this one is typing, without using the instance,
+    // returns false if some keys were not found, then the typing thread resolves them again
+    // empty if keys can't be resolved in the background
+    std::function<bool(std::u32string_view text, PackedKeyCode *key_codes)>
+    background_key_resolver();
+    // does everything the backend would do lazily before the first key
+    AutoTypeResult prepare_backend(const ActiveWindowArgs &args);
+    AutoTypeResult type_text(TextReader &reader);
+    // maps missing keys of the current chunk and the ones read after it,
+    // chunks_mapped is set to the number of chunks mapped after the current one
+    AutoTypeResult map_queued_missing_keys(TextPipeline &pipeline, size_t &chunks_mapped);
+    PackedKeyCode *key_codes_buffer(size_t size);
+    void release_key_codes_buffer();
 
   public:
     AutoType();
@@ -132,6 +271,14 @@ class AutoType {
 
     AutoTypeResult text(std::u32string_view str);
     AutoTypeResult text(std::wstring_view str);
+    AutoTypeResult text(std::string_view utf8_str);
+    AutoTypeResult text(std::u16string_view str);
+    // text is pulled in small chunks, memory use doesn't depend on its length
+    AutoTypeResult text(const TextChunkReader &reader);
+    AutoTypeResult text(std::istream &utf8_stream);
+
+    AutoTypeResult compile(std::u32string_view str, TypingProgram &program);
+    AutoTypeResult run(const TypingProgram &program);
 
     AutoTypeResult key_press(KeyCode code, Modifier modifier = Modifier::None);
 
@@ -143,6 +290,17 @@ class AutoType {
     void set_auto_unpress_modifiers(bool auto_unpress_modifiers);
     void set_unpress_modifiers_total_wait_time(std::chrono::milliseconds time);
     void set_check_pressed_modifiers(bool check_pressed_modifiers);
+    void set_batch_flush_chunk_size(size_t key_events);
+    void set_key_mapping_idle_time(std::chrono::milliseconds time);
+    void set_use_scratch_keyboard_group(bool use_scratch_keyboard_group);
+    void set_cancellation_token(std::optional<CancellationToken> token);
+    [[nodiscard]] AutoTypeStats stats() const;
+
+    // Connects and reads the keyboard layout in advance, so that the first key is sent
+    // without a delay, pass the args which will be used for active_window
+    AutoTypeResult warm_up(ActiveWindowArgs args = {});
+    // true after a successful warm_up, can be checked from any thread
+    [[nodiscard]] bool is_hot() const;
 
     AutoTypeResult key_move(Direction direction, KeyCode code, Modifier modifier = Modifier::None);
     AutoTypeResult key_move(Direction direction, Modifier modifier);
@@ -153,13 +311,25 @@ class AutoType {
     std::optional<KeyCodeWithModifiers> os_key_code_for_char(char32_t character);
     std::vector<std::optional<KeyCodeWithModifiers>>
     os_key_codes_for_chars(std::u32string_view text);
+    // Writes key codes of the characters to a buffer with space for at least text.size() elements
+    AutoTypeResult os_key_codes_for_chars(std::u32string_view text, PackedKeyCode *key_codes,
+                                          size_t key_codes_size);
     [[nodiscard]] AutoTypeTextTransaction begin_batch_text_entry();
+    AutoTypeResult flush();
 
     pid_t active_pid();
     AppWindow active_window(ActiveWindowArgs args = {});
     bool show_window(const AppWindow &window);
 };
 
+// Same as AutoType::os_key_codes_for_chars for any contiguous buffer: std::vector, std::array,
+// std::span; it's not a member, so that AutoType is the same in C++17 and C++20 code
+template <typename KeyCodes>
+inline AutoTypeResult os_key_codes_for_chars(AutoType &typer, std::u32string_view text,
+                                             KeyCodes &&key_codes) {
+    return typer.os_key_codes_for_chars(text, std::data(key_codes), std::size(key_codes));
+}
+
 } // namespace keyboard_auto_type
 
 #endif
@@ -0,0 +1,170 @@
+#include "async-auto-type.h"
+
+#include <stdexcept>
+
+#include "utils.h"
+
+namespace keyboard_auto_type {
+
+AsyncAutoType::AsyncAutoType()
+    : head_(new JobNode()), tail_(head_.load()), worker_([this] { run_worker(); }) {}
+
+AsyncAutoType::~AsyncAutoType() {
+    // don't type what's left in the queue: the running job is cancelled,
+    // the queued ones are completed with Cancelled without being started
+    cancel();
+    stopping_ = true;
+    {
+        std::lock_guard lock(wait_mutex_);
+        wait_cv_.notify_one();
+    }
+    worker_.join();
+    delete tail_;
+}
+
+std::future<AutoTypeResult> AsyncAutoType::submit(Job job) {
+    auto *node = new JobNode();
+    node->job = std::move(job);
+    auto future = node->promise.get_future();
+    push(node);
+    return future;
+}
+
+void AsyncAutoType::submit(Job job, Callback callback) {
+    auto *node = new JobNode();
+    node->job = std::move(job);
+    node->callback = std::move(callback);
+    push(node);
+}
+
+std::future<AutoTypeResult> AsyncAutoType::text(std::u32string str) {
+    return submit([str = std::move(str)](AutoType &typer) { return typer.text(str); });
+}
+
+std::future<AutoTypeResult> AsyncAutoType::text(std::string utf8_str) {
+    return submit([str = std::move(utf8_str)](AutoType &typer) { return typer.text(str); });
+}
+
+std::future<AutoTypeResult> AsyncAutoType::text(TextChunkReader reader) {
+    return submit([reader = std::move(reader)](AutoType &typer) { return typer.text(reader); });
+}
+
+std::future<AutoTypeResult> AsyncAutoType::key_press(KeyCode code, Modifier modifier) {
+    return submit([=](AutoType &typer) { return typer.key_press(code, modifier); });
+}
+
+std::future<AutoTypeResult> AsyncAutoType::shortcut(KeyCode code) {
+    return submit([=](AutoType &typer) { return typer.shortcut(code); });
+}
+
+std::future<AutoTypeResult> AsyncAutoType::warm_up(ActiveWindowArgs args) {
+    return submit([this, args](AutoType &typer) {
+        auto result = typer.warm_up(args);
+        hot_ = typer.is_hot();
+        return result;
+    });
+}
+
+bool AsyncAutoType::is_hot() const { return hot_; }
+
+void AsyncAutoType::cancel() {
+    std::lock_guard lock(cancel_mutex_);
+    cancelled_job_id_ = last_job_id_;
+    if (running_job_id_ && running_job_id_ <= cancelled_job_id_) {
+        cancellation_token_.cancel();
+    }
+}
+
+void AsyncAutoType::push(JobNode *node) {
+    node->id = ++last_job_id_;
+
+    auto *prev = head_.exchange(node);
+    prev->next.store(node);
+
+    // the worker checks the queue under the lock before going to sleep,
+    // so the lock is only needed if it's waiting
+    if (worker_waiting_) {
+        std::lock_guard lock(wait_mutex_);
+        wait_cv_.notify_one();
+    }
+}
+
+AsyncAutoType::JobNode *AsyncAutoType::pop() {
+    // tail_ is a consumed node, the next one contains the job
+    auto *next = tail_->next.load();
+    if (!next) {
+        return nullptr;
+    }
+    delete tail_;
+    tail_ = next;
+    return next;
+}
+
+void AsyncAutoType::run_worker() {
+    AutoType typer;
+    typer.set_cancellation_token(cancellation_token_);
+
+    while (true) {
+        auto *node = pop();
+        if (!node) {
+            std::unique_lock lock(wait_mutex_);
+            worker_waiting_ = true;
+            while (!(node = pop()) && !stopping_) {
+                wait_cv_.wait(lock);
+            }
+            worker_waiting_ = false;
+        }
+        if (!node) {
+            return;
+        }
+        run_job(typer, *node);
+    }
+}
+
+void AsyncAutoType::run_job(AutoType &typer, JobNode &node) {
+    auto result = AutoTypeResult::Ok;
+    std::exception_ptr error;
+
+    bool is_cancelled = false;
+    {
+        std::lock_guard lock(cancel_mutex_);
+        running_job_id_ = node.id;
+        cancellation_token_.reset();
+        is_cancelled = node.id <= cancelled_job_id_;
+    }
+
+#if __cpp_exceptions
+    try {
+#endif
+        if (is_cancelled) {
+            result = throw_or_return(AutoTypeResult::Cancelled, "Cancelled before start");
+        } else {
+            result = node.job(typer);
+        }
+#if __cpp_exceptions
+    } catch (const std::invalid_argument &) {
+        result = AutoTypeResult::BadArg;
+        error = std::current_exception();
+    } catch (const AutoTypeError &e) {
+        result = e.result();
+        error = std::current_exception();
+    } catch (...) {
+        result = AutoTypeResult::OsError;
+        error = std::current_exception();
+    }
+#endif
+
+    // release captured job state before reporting completion
+    node.job = nullptr;
+
+    if (node.callback) {
+        node.callback(result, error);
+        node.callback = nullptr;
+    } else if (error) {
+        node.promise.set_exception(error);
+    } else {
+        node.promise.set_value(result);
+    }
+}
+
+} // namespace keyboard_auto_type
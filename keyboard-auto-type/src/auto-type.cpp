@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <array>
 #include <chrono>
-#include <thread>
+#include <exception>
 
 #include "keyboard-auto-type.h"
+#include "text-pipeline.h"
+#include "text-reader.h"
 #include "utils.h"
 
 namespace keyboard_auto_type {
@@ -21,94 +24,426 @@ constexpr std::array MODIFIERS_KEY_CODES{
     ModifierKeyCode{Modifier::Ctrl, Modifier::RightCtrl, KeyCode::Ctrl, KeyCode::RightCtrl},
 };
 
-AutoTypeResult AutoType::text(std::u32string_view str) {
-    if (str.length() == 0) {
-        return AutoTypeResult::Ok;
-    }
+// Converts characters to key events and sends them to Sink, which has the same key_move
+// overloads as AutoType: either AutoType itself or a recorder that builds a TypingProgram
+template <typename Sink> class TextPlanner {
+  private:
+    Sink &sink_;
+    Modifier pressed_modifiers_ = Modifier::None;
 
-    auto result = AutoTypeResult::Ok;
-    if (check_pressed_modifiers_) {
-        result = ensure_modifier_not_pressed();
-        if (result != AutoTypeResult::Ok) {
-            return result;
-        }
-    }
-
-    auto native_keys = os_key_codes_for_chars(str);
-    auto length = str.length();
+  public:
+    explicit TextPlanner(Sink &sink) : sink_(sink) {}
 
-    auto pressed_modifiers = Modifier::None;
-
-    auto tx = begin_batch_text_entry();
-
-    for (size_t i = 0; i < length; i++) {
-        auto character = str[i];
+    AutoTypeResult add(char32_t character, PackedKeyCode native_key_with_modifiers) {
         if (!character) {
             return throw_or_return(AutoTypeResult::BadArg,
                                    "Typing a null character is not possible");
         }
 
-        auto native_key_with_modifiers = native_keys[i];
-
+        auto result = AutoTypeResult::Ok;
         std::optional<os_key_code_t> code;
         auto modifier = Modifier::None;
 
         if (native_key_with_modifiers.has_value()) {
-            code = native_key_with_modifiers->code;
-            modifier = native_key_with_modifiers->modifier;
+            code = native_key_with_modifiers.code();
+            modifier = native_key_with_modifiers.modifier();
 
             for (auto mod_key : MODIFIERS_KEY_CODES) {
                 auto mod_check = mod_key.neutral_mod;
                 auto is_pressed = (modifier & mod_check) == mod_check;
-                auto was_pressed = (pressed_modifiers & mod_check) == mod_check;
+                auto was_pressed = (pressed_modifiers_ & mod_check) == mod_check;
                 if (is_pressed && !was_pressed) {
-                    result = key_move(Direction::Down, mod_check);
+                    result = sink_.key_move(Direction::Down, mod_check);
                 } else if (!is_pressed && was_pressed) {
-                    result = key_move(Direction::Up, mod_check);
+                    result = sink_.key_move(Direction::Up, mod_check);
                 }
                 if (result != AutoTypeResult::Ok) {
                     return result;
                 }
             }
 
-            pressed_modifiers = modifier;
-        } else if (pressed_modifiers != Modifier::None) {
-            result = key_move(Direction::Up, pressed_modifiers);
+            pressed_modifiers_ = modifier;
+        } else if (pressed_modifiers_ != Modifier::None) {
+            result = sink_.key_move(Direction::Up, pressed_modifiers_);
             if (result != AutoTypeResult::Ok) {
                 return result;
             }
-            pressed_modifiers = Modifier::None;
+            pressed_modifiers_ = Modifier::None;
         }
 
-        result = key_move(Direction::Down, character, code, modifier);
+        result = sink_.key_move(Direction::Down, character, code, modifier);
         if (result != AutoTypeResult::Ok) {
             return result;
         }
 
-        result = key_move(Direction::Up, character, code, modifier);
-        if (result != AutoTypeResult::Ok) {
-            return result;
+        return sink_.key_move(Direction::Up, character, code, modifier);
+    }
+
+    AutoTypeResult finish() {
+        if (pressed_modifiers_ == Modifier::None) {
+            return AutoTypeResult::Ok;
+        }
+        auto result = sink_.key_move(Direction::Up, pressed_modifiers_);
+        if (result == AutoTypeResult::Ok) {
+            pressed_modifiers_ = Modifier::None;
+        }
+        return result;
+    }
+};
+
+// Records key events instead of sending them
+class TypingProgramRecorder {
+  private:
+    AutoType &typer_;
+    std::vector<TypingProgramEvent> &events_;
+
+  public:
+    TypingProgramRecorder(AutoType &typer, std::vector<TypingProgramEvent> &events)
+        : typer_(typer), events_(events) {}
+
+    AutoTypeResult key_move(Direction direction, char32_t character,
+                            std::optional<os_key_code_t> code, Modifier modifier) {
+        TypingProgramEvent event{};
+        event.direction = direction;
+        event.modifier = modifier;
+        event.character = character;
+        event.code = code;
+        events_.push_back(event);
+        return AutoTypeResult::Ok;
+    }
+
+    AutoTypeResult key_move(Direction direction, Modifier modifier) {
+        for (auto mod_key : MODIFIERS_KEY_CODES) {
+            if ((modifier & mod_key.neutral_mod) == mod_key.neutral_mod) {
+                auto key = (modifier & mod_key.right_mod) == mod_key.right_mod ? mod_key.right_key
+                                                                                : mod_key.left_key;
+                auto code = typer_.os_key_code(key);
+                if (!code.has_value()) {
+                    return throw_or_return(AutoTypeResult::BadArg,
+                                           std::string("Key code ") +
+                                               std::to_string(static_cast<int>(key)) +
+                                               " not supported");
+                }
+                key_move(direction, 0, code, Modifier::None);
+            }
         }
+        return AutoTypeResult::Ok;
     }
+};
 
-    if (pressed_modifiers != Modifier::None) {
-        result = key_move(Direction::Up, pressed_modifiers);
+AutoTypeResult AutoType::text(std::u32string_view str) {
+    U32TextReader reader(str);
+    return type_text(reader);
+}
+
+AutoTypeResult AutoType::text(std::string_view str) {
+    auto invalid_pos = find_invalid_utf8(str);
+    if (invalid_pos.has_value()) {
+        return throw_or_return(AutoTypeResult::BadArg, "Invalid UTF-8 sequence at byte " +
+                                                           std::to_string(invalid_pos.value()));
+    }
+    Utf8TextReader reader(str);
+    return type_text(reader);
+}
+
+AutoTypeResult AutoType::text(std::u16string_view str) {
+    auto invalid_pos = find_invalid_utf16(str);
+    if (invalid_pos.has_value()) {
+        return throw_or_return(AutoTypeResult::BadArg, "Invalid UTF-16 sequence at index " +
+                                                           std::to_string(invalid_pos.value()));
+    }
+    Utf16TextReader reader(str);
+    return type_text(reader);
+}
+
+AutoTypeResult AutoType::text(std::wstring_view str) {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+        auto invalid_pos = find_invalid_utf16(str);
+        if (invalid_pos.has_value()) {
+            return throw_or_return(AutoTypeResult::BadArg, "Invalid UTF-16 sequence at index " +
+                                                               std::to_string(invalid_pos.value()));
+        }
+        Utf16TextReader reader(str);
+        return type_text(reader);
+    } else {
+        WideTextReader reader(str);
+        return type_text(reader);
+    }
+}
+
+AutoTypeResult AutoType::text(const TextChunkReader &reader) {
+    if (!reader) {
+        return throw_or_return(AutoTypeResult::BadArg, "Empty text reader");
+    }
+    CallbackTextReader text_reader(reader);
+    return type_text(text_reader);
+}
+
+AutoTypeResult AutoType::text(std::istream &utf8_stream) {
+    Utf8StreamTextReader reader(utf8_stream);
+    return type_text(reader);
+}
+
+AutoTypeResult AutoType::type_text(TextReader &reader) {
+    stats_ = {};
+
+    std::u32string_view chunk;
+    auto result = reader.read(chunk);
+    if (result != AutoTypeResult::Ok) {
+        return throw_or_return(result, reader.error());
+    }
+    if (chunk.empty()) {
+        return AutoTypeResult::Ok;
+    }
+
+    if (check_pressed_modifiers_) {
+        result = ensure_modifier_not_pressed();
         if (result != AutoTypeResult::Ok) {
             return result;
         }
     }
 
+    auto tx = begin_batch_text_entry();
+
+    TextPlanner planner(*this);
+    auto type_chunk = [&](std::u32string_view chars, const PackedKeyCode *native_keys) {
+        for (size_t i = 0; i < chars.length(); i++) {
+            if (is_cancelled()) {
+                // release the modifiers pressed by us and send what has been queued so far
+                return release_and_cancel(planner.finish());
+            }
+            auto add_result = planner.add(chars[i], native_keys[i]); // NOLINT(*-pointer-arithmetic)
+            if (add_result != AutoTypeResult::Ok) {
+                return add_result;
+            }
+            stats_.chars_sent++;
+        }
+        return AutoTypeResult::Ok;
+    };
+
+    if (chunk.length() < TEXT_READER_CHUNK_SIZE) {
+        // the text is short or comes in small parts, it's not worth using a thread
+        while (!chunk.empty()) {
+            auto length = chunk.length();
+            auto *native_keys = key_codes_buffer(length);
+            result = os_key_codes_for_chars(chunk, native_keys, length);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            // missing keys are mapped for the whole chunk, so that we wait for the mapping once
+            result = map_missing_keys(native_keys, length);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            result = type_chunk(chunk, native_keys);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+
+            // the next chunk is decoded while the server is processing the events of this one,
+            // then they're flushed, so that the queue doesn't grow with the text
+            result = reader.read(chunk);
+            if (result != AutoTypeResult::Ok) {
+                planner.finish();
+                flush();
+                return throw_or_return(result, reader.error());
+            }
+            if (!chunk.empty()) {
+                result = flush();
+                if (result != AutoTypeResult::Ok) {
+                    return result;
+                }
+            }
+        }
+    } else {
+        // next chunks are read and resolved on the pipeline thread while this one is typing
+        if (!text_pipeline_) {
+            text_pipeline_ = std::make_unique<TextPipeline>();
+        }
+        auto &pipeline = *text_pipeline_;
+        pipeline.start(reader, chunk, background_key_resolver());
+        TextPipelineGuard pipeline_guard(pipeline);
+
+        // chunks after the current one with missing keys already mapped
+        size_t chunks_mapped_ahead = 0;
+        for (auto *resolved = &pipeline.next(); resolved->size; resolved = &pipeline.next()) {
+            if (chunks_mapped_ahead) {
+                chunks_mapped_ahead--;
+            } else {
+                result = map_queued_missing_keys(pipeline, chunks_mapped_ahead);
+                if (result != AutoTypeResult::Ok) {
+                    return result;
+                }
+            }
+            result = type_chunk(resolved->text(), resolved->keys.data());
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            result = flush();
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+        }
+        if (pipeline.result() != AutoTypeResult::Ok) {
+            planner.finish();
+            flush();
+#if __cpp_exceptions
+            if (pipeline.exception()) {
+                std::rethrow_exception(pipeline.exception());
+            }
+#endif
+            return throw_or_return(pipeline.result(), pipeline.error());
+        }
+    }
+
+    result = planner.finish();
+    if (result != AutoTypeResult::Ok) {
+        return result;
+    }
+
+    result = flush();
+    if (result != AutoTypeResult::Ok) {
+        return result;
+    }
+
     tx.done();
+    release_key_codes_buffer();
 
     return AutoTypeResult::Ok;
 }
 
-AutoTypeResult AutoType::text(std::wstring_view str) {
-    std::u32string ustr(str.begin(), str.end());
-    return text(ustr);
+AutoTypeResult AutoType::map_queued_missing_keys(TextPipeline &pipeline, size_t &chunks_mapped) {
+    // keys of all chunks that have been read are mapped with one request,
+    // so that we wait for the mapping to propagate once instead of once per chunk
+    size_t keys_count = 0;
+    chunks_mapped = 0;
+    for (size_t offset = 0;; offset++) {
+        auto *chunk = pipeline.peek(offset);
+        if (!chunk || !chunk->size) {
+            break;
+        }
+        if (!chunk->keys_resolved) {
+            auto result = os_key_codes_for_chars(chunk->text(), chunk->keys.data(), chunk->size);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            chunk->keys_resolved = true;
+        }
+        auto *keys = key_codes_buffer(keys_count + chunk->size);
+        std::copy_n(chunk->keys.begin(), chunk->size, keys + keys_count);
+        keys_count += chunk->size;
+        chunks_mapped = offset;
+    }
+    return map_missing_keys(key_codes_buffer(keys_count), keys_count);
+}
+
+AutoTypeResult AutoType::compile(std::u32string_view str, TypingProgram &program) {
+    program = TypingProgram();
+    program.layout_generation_ = keyboard_layout_generation();
+
+    auto length = str.length();
+    auto *native_keys = key_codes_buffer(length);
+    auto result = os_key_codes_for_chars(str, native_keys, length);
+    if (result != AutoTypeResult::Ok) {
+        program = TypingProgram();
+        return result;
+    }
+
+    // the number of events is known only approximately: key down and up for each character,
+    // plus some modifiers
+    program.events_.reserve(length * 2);
+
+    TypingProgramRecorder recorder(*this, program.events_);
+    TextPlanner planner(recorder);
+    for (size_t i = 0; i < length; i++) {
+        result = planner.add(str[i], native_keys[i]); // NOLINT(*-pointer-arithmetic)
+        if (result != AutoTypeResult::Ok) {
+            program = TypingProgram();
+            return result;
+        }
+    }
+    result = planner.finish();
+    if (result != AutoTypeResult::Ok) {
+        program = TypingProgram();
+        return result;
+    }
+    release_key_codes_buffer();
+
+    for (auto &event : program.events_) {
+        if (event.code.has_value()) {
+            event.native_key = native_key(event.code.value());
+            if (!event.native_key && event.character && event.direction == Direction::Down) {
+                program.unresolved_keys_.emplace_back(
+                    KeyCodeWithModifiers{event.code.value(), event.modifier});
+            }
+        }
+    }
+    program.events_.shrink_to_fit();
+    program.length_ = length;
+
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult AutoType::run(const TypingProgram &program) {
+    stats_ = {};
+
+    if (program.events_.empty()) {
+        return AutoTypeResult::Ok;
+    }
+
+    if (program.layout_generation_ != keyboard_layout_generation()) {
+        return throw_or_return(AutoTypeResult::LayoutChanged,
+                               "Keyboard layout has changed since the program was compiled");
+    }
+
+    auto result = AutoTypeResult::Ok;
+    if (check_pressed_modifiers_) {
+        result = ensure_modifier_not_pressed();
+        if (result != AutoTypeResult::Ok) {
+            return result;
+        }
+    }
+
+    auto tx = begin_batch_text_entry();
+
+    result = map_missing_keys(program.unresolved_keys_.data(), program.unresolved_keys_.size());
+    if (result != AutoTypeResult::Ok) {
+        return result;
+    }
+
+    // modifiers used by the last character, they are still pressed after its key up event
+    auto pressed_modifiers = Modifier::None;
+    auto at_char_boundary = true;
+
+    for (const auto &event : program.events_) {
+        if (at_char_boundary && is_cancelled()) {
+            return release_and_cancel(key_move(Direction::Up, pressed_modifiers));
+        }
+        result = key_move(event);
+        if (result != AutoTypeResult::Ok) {
+            return result;
+        }
+        at_char_boundary = event.character && event.direction == Direction::Up;
+        if (at_char_boundary) {
+            pressed_modifiers = event.modifier;
+            stats_.chars_sent++;
+        }
+    }
+
+    result = flush();
+    if (result != AutoTypeResult::Ok) {
+        return result;
+    }
+
+    tx.done();
+    release_key_codes_buffer();
+
+    return AutoTypeResult::Ok;
 }
 
 AutoTypeResult AutoType::key_press(KeyCode code, Modifier modifier) {
+    stats_ = {};
+
     auto key_code = os_key_code(code);
     if (!key_code.has_value()) {
         return throw_or_return(AutoTypeResult::BadArg, std::string("Key code ") +
@@ -116,6 +451,10 @@ AutoTypeResult AutoType::key_press(KeyCode code, Modifier modifier) {
                                                            " not supported");
     }
 
+    if (is_cancelled()) {
+        return cancelled_result();
+    }
+
     auto tx = begin_batch_text_entry();
 
     auto result = key_move(Direction::Down, modifier);
@@ -123,6 +462,10 @@ AutoTypeResult AutoType::key_press(KeyCode code, Modifier modifier) {
         return result;
     }
 
+    if (is_cancelled()) {
+        return release_and_cancel(key_move(Direction::Up, modifier));
+    }
+
     result = key_move(Direction::Down, 0, key_code, modifier);
     if (result != AutoTypeResult::Ok) {
         return result;
@@ -137,7 +480,13 @@ AutoTypeResult AutoType::key_press(KeyCode code, Modifier modifier) {
         return result;
     }
 
+    result = flush();
+    if (result != AutoTypeResult::Ok) {
+        return result;
+    }
+
     tx.done();
+    release_key_codes_buffer();
 
     return AutoTypeResult::Ok;
 }
@@ -147,14 +496,15 @@ AutoTypeResult AutoType::shortcut(KeyCode code) { return key_press(code, shortcu
 AutoTypeResult AutoType::ensure_modifier_not_pressed() {
     auto start_time = std::chrono::system_clock::now();
 
-    auto tx = begin_batch_text_entry();
-
     while (true) {
         auto pressed_modifiers = get_pressed_modifiers();
         if (pressed_modifiers == Modifier::None) {
             return AutoTypeResult::Ok;
         }
         if (auto_unpress_modifiers_) {
+            // the transaction is held only while sending the keys, not while waiting for the user,
+            // so that other instances sharing the connection are not blocked
+            auto tx = begin_batch_text_entry();
             for (auto mod_key : MODIFIERS_KEY_CODES) {
                 if ((pressed_modifiers & mod_key.neutral_mod) == mod_key.neutral_mod) {
                     if ((pressed_modifiers & mod_key.right_mod) == mod_key.right_mod) {
@@ -164,17 +514,26 @@ AutoTypeResult AutoType::ensure_modifier_not_pressed() {
                     }
                 }
             }
+            auto result = flush();
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            tx.done();
         }
-        std::this_thread::sleep_for(KEY_HOLD_LOOP_WAIT_TIME);
         auto elapsed = std::chrono::system_clock::now() - start_time;
         auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(elapsed);
         if (elapsed_ms > unpress_modifiers_total_wait_time_) {
             break;
         }
+        // returns earlier if the platform can notify us about modifier changes
+        wait_for_modifiers_change(
+            std::min(KEY_HOLD_LOOP_WAIT_TIME, unpress_modifiers_total_wait_time_ - elapsed_ms +
+                                                  std::chrono::milliseconds(1)));
+        if (is_cancelled()) {
+            return cancelled_result();
+        }
     }
 
-    tx.done();
-
     return throw_or_return(AutoTypeResult::ModifierNotReleased, "Modifier key not released");
 }
 
@@ -190,6 +549,63 @@ void AutoType::set_check_pressed_modifiers(bool check_pressed_modifiers) {
     check_pressed_modifiers_ = check_pressed_modifiers;
 }
 
+AutoTypeStats AutoType::stats() const { return stats_; }
+
+AutoTypeResult AutoType::warm_up(ActiveWindowArgs args) {
+    auto result = prepare_backend(args);
+    hot_ = result == AutoTypeResult::Ok;
+    return result;
+}
+
+bool AutoType::is_hot() const { return hot_; }
+
+void AutoType::set_cancellation_token(std::optional<CancellationToken> token) {
+    cancellation_token_ = std::move(token);
+}
+
+bool AutoType::is_cancelled() const {
+    return cancellation_token_.has_value() && cancellation_token_->is_cancelled();
+}
+
+PackedKeyCode *AutoType::key_codes_buffer(size_t size) {
+    if (key_codes_buffer_.size() < size) {
+        key_codes_buffer_.resize(size);
+    }
+    return key_codes_buffer_.data();
+}
+
+void AutoType::release_key_codes_buffer() {
+    if (key_codes_buffer_.size() > MAX_RETAINED_KEY_CODES) {
+        key_codes_buffer_ = {};
+    }
+}
+
+std::vector<std::optional<KeyCodeWithModifiers>>
+AutoType::os_key_codes_for_chars(std::u32string_view text) {
+    std::vector<PackedKeyCode> key_codes(text.length());
+    os_key_codes_for_chars(text, key_codes.data(), key_codes.size());
+    std::vector<std::optional<KeyCodeWithModifiers>> result(text.length());
+    std::transform(key_codes.begin(), key_codes.end(), result.begin(),
+                   [](auto key_code) { return key_code.unpack(); });
+    return result;
+}
+
+AutoTypeResult AutoType::cancelled_result() {
+    return throw_or_return(AutoTypeResult::Cancelled, std::string("Cancelled after ") +
+                                                          std::to_string(stats_.chars_sent) +
+                                                          " characters");
+}
+
+AutoTypeResult AutoType::release_and_cancel(AutoTypeResult release_result) {
+    if (release_result == AutoTypeResult::Ok) {
+        release_result = flush();
+    }
+    if (release_result != AutoTypeResult::Ok) {
+        return release_result;
+    }
+    return cancelled_result();
+}
+
 AutoTypeResult AutoType::key_move(Direction direction, KeyCode code, Modifier modifier) {
     auto key_code_opt = os_key_code(code);
     if (!key_code_opt.has_value()) {
@@ -222,6 +638,25 @@ AutoTypeResult AutoType::key_move(Direction direction, Modifier modifier) {
     return AutoTypeResult::Ok;
 }
 
+const std::vector<TypingProgramEvent> &TypingProgram::events() const { return events_; }
+
+size_t TypingProgram::length() const { return length_; }
+
+uint64_t TypingProgram::layout_generation() const { return layout_generation_; }
+
+AutoTypeError::AutoTypeError(AutoTypeResult result, const std::string &message)
+    : std::runtime_error(message), result_(result) {}
+
+AutoTypeResult AutoTypeError::result() const noexcept { return result_; }
+
+CancellationToken::CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+void CancellationToken::cancel() const noexcept { cancelled_->store(true); }
+
+void CancellationToken::reset() const noexcept { cancelled_->store(false); }
+
+bool CancellationToken::is_cancelled() const noexcept { return cancelled_->load(); }
+
 AutoTypeTextTransaction::AutoTypeTextTransaction(std::function<void()> end_callback)
     : end_callback_(std::move(end_callback)) {}
 
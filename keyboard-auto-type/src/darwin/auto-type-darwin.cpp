@@ -11,6 +11,7 @@
 #include "key-map.h"
 #include "keyboard-auto-type.h"
 #include "native-methods.h"
+#include "text-pipeline.h"
 #include "utils.h"
 
 namespace keyboard_auto_type {
@@ -77,6 +78,7 @@ class AutoType::AutoTypeImpl {
     static constexpr int MAX_KEYBOARD_LAYOUT_CHAR_CODE = 127;
     std::unordered_map<char32_t, KeyCodeWithModifiers> keyboard_layout_ = {};
     CFDataRef keyboard_layout_data_ = nullptr;
+    uint64_t layout_generation_ = 0;
 
   public:
     AutoTypeResult key_move(Direction direction, char32_t character, os_key_code_t code,
@@ -196,8 +198,11 @@ class AutoType::AutoTypeImpl {
         }
 
         keyboard_layout_data_ = layout_data;
+        layout_generation_++;
     }
 
+    uint64_t layout_generation() const { return layout_generation_; }
+
     std::optional<KeyCodeWithModifiers> char_to_key_code(char32_t character) {
         auto code = keyboard_layout_.find(character);
         if (code == keyboard_layout_.end()) {
@@ -238,6 +243,31 @@ AutoTypeResult AutoType::key_move(Direction direction, char32_t character,
     return impl_->key_move(direction, character, code.value_or(0), flags);
 }
 
+uint64_t AutoType::keyboard_layout_generation() {
+    impl_->read_keyboard_layout();
+    return impl_->layout_generation();
+}
+
+uint32_t AutoType::native_key(os_key_code_t /*unused*/) { return 0; }
+
+// the layout is read and cached by the typing thread
+std::function<bool(std::u32string_view, PackedKeyCode *)> AutoType::background_key_resolver() {
+    return nullptr;
+}
+
+AutoTypeResult AutoType::prepare_backend(const ActiveWindowArgs & /*unused*/) {
+    impl_->read_keyboard_layout();
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult AutoType::map_missing_keys(const PackedKeyCode * /*unused*/, size_t /*unused*/) {
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult AutoType::key_move(const TypingProgramEvent &event) {
+    return key_move(event.direction, event.character, event.code, event.modifier);
+}
+
 Modifier AutoType::get_pressed_modifiers() {
     auto flags = CGEventSourceFlagsState(kCGEventSourceStateHIDSystemState);
     auto pressed_modifiers = Modifier::None;
@@ -249,6 +279,10 @@ Modifier AutoType::get_pressed_modifiers() {
     return pressed_modifiers;
 }
 
+void AutoType::wait_for_modifiers_change(std::chrono::milliseconds timeout) {
+    std::this_thread::sleep_for(timeout);
+}
+
 Modifier AutoType::shortcut_modifier() { return Modifier::Command; }
 
 std::optional<os_key_code_t> AutoType::os_key_code(KeyCode code) {
@@ -267,15 +301,18 @@ std::optional<KeyCodeWithModifiers> AutoType::os_key_code_for_char(char32_t char
     return impl_->char_to_key_code(character);
 }
 
-std::vector<std::optional<KeyCodeWithModifiers>>
-AutoType::os_key_codes_for_chars(std::u32string_view text) {
+AutoTypeResult AutoType::os_key_codes_for_chars(std::u32string_view text,
+                                                PackedKeyCode *key_codes, size_t key_codes_size) {
+    if (key_codes_size < text.length()) {
+        return throw_or_return(AutoTypeResult::BadArg, "Key codes buffer is too small");
+    }
     impl_->read_keyboard_layout();
-    std::vector<std::optional<KeyCodeWithModifiers>> result(text.length());
     auto length = text.length();
     for (size_t i = 0; i < length; i++) {
-        result[i] = impl_->char_to_key_code(text[i]);
+        // NOLINTNEXTLINE(*-pointer-arithmetic)
+        key_codes[i] = PackedKeyCode(impl_->char_to_key_code(text[i]));
     }
-    return result;
+    return AutoTypeResult::Ok;
 }
 
 pid_t AutoType::active_pid() {
@@ -351,4 +388,12 @@ bool AutoType::show_window(const AppWindow &window) {
 
 AutoTypeTextTransaction AutoType::begin_batch_text_entry() { return AutoTypeTextTransaction(); }
 
+AutoTypeResult AutoType::flush() { return AutoTypeResult::Ok; }
+
+void AutoType::set_batch_flush_chunk_size(size_t /*unused*/) {}
+
+void AutoType::set_key_mapping_idle_time(std::chrono::milliseconds /*unused*/) {}
+
+void AutoType::set_use_scratch_keyboard_group(bool /*unused*/) {}
+
 } // namespace keyboard_auto_type
@@ -7,11 +7,11 @@
 
 namespace keyboard_auto_type {
 
+bool init_atspi() { return atspi_is_initialized() || !atspi_init(); }
+
 std::string get_browser_url_using_atspi(pid_t pid) {
-    if (!atspi_is_initialized()) {
-        if (atspi_init()) {
-            return "";
-        }
+    if (!init_atspi()) {
+        return "";
     }
 
     std::vector<GObject *> to_free;
@@ -6,6 +6,8 @@
 
 namespace keyboard_auto_type {
 
+// Connects to the accessibility bus if it hasn't been done yet, returns false on failure
+bool init_atspi();
 std::string get_browser_url_using_atspi(pid_t pid);
 
 } // namespace keyboard_auto_type
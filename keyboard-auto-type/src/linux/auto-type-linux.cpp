@@ -2,10 +2,16 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/XTest.h>
+#include <poll.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <climits>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
 #include <vector>
 
@@ -14,16 +20,28 @@
 #include "atspi-helpers.h"
 #include "key-map.h"
 #include "keyboard-auto-type.h"
+#include "text-pipeline.h"
 #include "utils.h"
+#include "x11-connection.h"
 #include "x11-helpers.h"
+#include "x11-key-mapping-reaper.h"
+#include "x11-keyboard-layout.h"
 #include "x11-keysym-map.h"
+#include "x11-layout-snapshot.h"
 
 namespace keyboard_auto_type {
 
-struct KeyCodeWithMask {
-    uint8_t key_code = 0;
+// Keyboard state mirrored from XkbStateNotify events
+struct KeyboardState {
     uint8_t group = 0;
-    uint8_t mod_mask = 0;
+    uint8_t locked_mods = 0;
+    uint8_t base_mods = 0;
+};
+
+struct PendingKeyEvent {
+    unsigned long serial = 0; // NOLINT (google-runtime-int)
+    char32_t character = 0;
+    KeySym key_sym = 0;
 };
 
 constexpr std::array OS_KEY_CODE_SUPPORTED_MODIFIERS_MASKS{
@@ -43,9 +61,28 @@ constexpr std::array KEY_CODES_MODIFIERS{
 
 static constexpr auto KEY_MAPPING_PROPAGATION_DELAY = std::chrono::milliseconds(200);
 
+static constexpr auto DEFAULT_KEY_MAPPING_IDLE_TIME = std::chrono::milliseconds(5'000);
+
 static constexpr auto MAX_KEYSYM = 0x0110FFFFU;
 
-// static constexpr uint8_t EMPTY_KEY_CODE_FOR_DEBUGGING = 0xcc;
+static constexpr size_t DEFAULT_BATCH_FLUSH_CHUNK_SIZE = 64;
+
+// the keymap can be changed while we're reading the layout, usually it's done in one step
+static constexpr auto MAX_LAYOUT_READ_ATTEMPTS = 3;
+
+// events can be read from the shared connection by another instance while we're waiting,
+// so the socket is polled in short intervals instead of once until the deadline
+static constexpr auto EVENTS_POLL_INTERVAL = std::chrono::milliseconds(10);
+
+// characters are converted to key syms in chunks of this size
+static constexpr size_t KEY_SYMS_CHUNK_SIZE = 256;
+
+static constexpr auto STATE_NOTIFY_DETAILS = XkbModifierStateMask | XkbGroupStateMask;
+
+// KeyCodeWithMask packed to TypingProgramEvent::native_key
+static constexpr auto NATIVE_KEY_GROUP_SHIFT = 8U;
+static constexpr auto NATIVE_KEY_MOD_MASK_SHIFT = 16U;
+static constexpr auto NATIVE_KEY_BYTE_MASK = 0xFFU;
 
 constexpr std::array BROWSER_APP_NAMES{
     "Firefox",
@@ -56,50 +93,192 @@ constexpr std::array BROWSER_APP_NAMES{
 
 class AutoType::AutoTypeImpl {
   private:
-    Display *display_ = nullptr;
-    std::optional<bool> is_supported_;
-    std::optional<uint8_t> active_keyboard_group_; // aka "layout" or "input language"
-    std::unordered_map<KeySym, KeyCodeWithMask> keyboard_layout_ = {};
-    uint8_t empty_key_code_ = 0; // EMPTY_KEY_CODE_FOR_DEBUGGING;
-    KeySym empty_key_code_key_sym_ = 0;
+    std::shared_ptr<X11Connection> connection_;
+    uint64_t event_queue_id_ = 0;
+    // held while a transaction is open
+    std::unique_lock<std::recursive_mutex> transaction_lock_;
+    bool xkb_events_selected_ = false;
+    uint64_t modifier_changes_ = 0;
+    std::optional<KeyboardState> keyboard_state_;
+    unsigned long key_mapping_serial_ = 0;   // NOLINT (google-runtime-int)
+    unsigned long mapping_notify_serial_ = 0; // NOLINT (google-runtime-int)
+    Atom wm_protocols_atom_ = 0;
+    Atom net_wm_ping_atom_ = 0;
+    Time ping_reply_ = 0;
+    std::optional<std::array<uint8_t, KEY_CODES_MODIFIERS.size()>> modifier_key_codes_;
+    // group and modifiers locked by us during the transaction
+    std::optional<uint8_t> locked_group_;
+    std::optional<uint8_t> original_locked_mods_;
+    uint8_t locked_mods_ = 0;
+    std::shared_ptr<X11KeyboardLayoutWatcher> layout_watcher_ =
+        X11KeyboardLayoutWatcher::shared(XDisplayName(nullptr));
+    // taken from the watcher before each operation and kept until the end of the transaction
+    std::shared_ptr<const X11KeyboardLayout> keyboard_layout_;
+    // owned by the reaper of the connection outside of transactions,
+    // so that the next call of any instance can reuse them
+    std::vector<X11KeyMapping> extra_key_mappings_;
+    std::chrono::milliseconds key_mapping_idle_time_ = DEFAULT_KEY_MAPPING_IDLE_TIME;
+    bool use_scratch_keyboard_group_ = false;
+    // keys in a temporary keyboard group, installed for the current transaction
+    X11KeySymTable scratch_group_keys_;
     bool in_batch_text_entry_ = false;
+    size_t batch_flush_chunk_size_ = DEFAULT_BATCH_FLUSH_CHUNK_SIZE;
+    std::vector<PendingKeyEvent> pending_key_events_;
+    std::optional<X11ErrorTrap> error_trap_;
+    AutoTypeStats &stats_;
 
   public:
-    AutoTypeImpl() = default;
+    explicit AutoTypeImpl(AutoTypeStats &stats) : stats_(stats) {}
     AutoTypeImpl(const AutoTypeImpl &) = delete;
     AutoTypeImpl &operator=(const AutoTypeImpl &) = delete;
     AutoTypeImpl(AutoTypeImpl &&) = delete;
     AutoTypeImpl &operator=(AutoTypeImpl &&) = delete;
 
     ~AutoTypeImpl() {
-        if (display_) {
-            remove_extra_key_mapping();
-            XCloseDisplay(display_);
+        if (connection_) {
+            std::lock_guard lock(connection_->transaction_mutex());
+            discard_pending_key_events();
+            remove_scratch_keyboard_group();
+            // idle mappings are left to the reaper, they're removed with the last instance
+            remove_extra_key_mappings();
+            connection_->remove_event_queue(event_queue_id_);
         }
     }
 
     Display *display() {
-        if (!display_) {
-            display_ = XOpenDisplay(nullptr);
+        if (!connection_) {
+            connection_ = X11Connection::shared(XDisplayName(nullptr));
+            if (!connection_) {
+                return nullptr;
+            }
+            event_queue_id_ = connection_->add_event_queue();
         }
-        return display_;
+        return connection_->display();
     }
 
-    bool is_supported() {
-        if (is_supported_.has_value()) {
-            return is_supported_.value();
+    bool is_supported() { return display() && connection_->is_supported(); }
+
+    X11ReservedKeys &reserved_keys() { return connection_->reserved_keys(); }
+
+    void select_xkb_events() {
+        if (xkb_events_selected_ || !is_supported()) {
+            return;
         }
-        if (display()) {
-            int i = 0;
-            is_supported_ = XTestQueryExtension(display(), &i, &i, &i, &i) &&
-                            XkbQueryExtension(display(), &i, &i, &i, &i, &i);
-        } else {
-            is_supported_ = false;
+        XkbSelectEventDetails(display(), XkbUseCoreKbd, XkbStateNotify, STATE_NOTIFY_DETAILS,
+                              STATE_NOTIFY_DETAILS);
+        xkb_events_selected_ = true;
+    }
+
+    // Handles all events already received from the server, doesn't block
+    void process_pending_events() {
+        if (!display()) {
+            return;
+        }
+        if (connection_->take_lost_events(event_queue_id_)) {
+            // we haven't read events for a long time, the state mirror can be outdated
+            keyboard_state_.reset();
+            modifier_key_codes_.reset();
+        }
+        while (auto next_event = connection_->next_event(event_queue_id_)) {
+            auto &event = next_event.value();
+            if (event.type == MappingNotify) {
+                modifier_key_codes_.reset();
+                mapping_notify_serial_ = event.xany.serial; // NOLINT(*-union-access)
+            } else if (event.type == ClientMessage) {
+                const auto &message = event.xclient; // NOLINT(*-union-access)
+                if (message.message_type == wm_protocols_atom_ && wm_protocols_atom_ &&
+                    static_cast<Atom>(message.data.l[0]) == net_wm_ping_atom_) {
+                    ping_reply_ = static_cast<Time>(message.data.l[1]);
+                }
+            } else if (event.type == connection_->xkb_event_base()) {
+                auto *xkb_event = reinterpret_cast<XkbEvent *>(&event);
+                if (xkb_event->any.xkb_type == XkbStateNotify) { // NOLINT(*-union-access)
+                    const auto &state = xkb_event->state;      // NOLINT(*-union-access)
+                    if (keyboard_state_.has_value()) {
+                        keyboard_state_->group = static_cast<uint8_t>(state.group);
+                        keyboard_state_->locked_mods = state.locked_mods;
+                        keyboard_state_->base_mods = state.base_mods;
+                    }
+                    if (state.changed & XkbModifierStateMask) {
+                        modifier_changes_++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Processes events until the condition is met, returns false on timeout
+    template <typename Condition>
+    bool wait_for_events(std::chrono::steady_clock::time_point deadline, Condition condition) {
+        while (true) {
+            process_pending_events();
+            if (condition()) {
+                return true;
+            }
+            auto time_left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (time_left.count() <= 0) {
+                return false;
+            }
+            pollfd fd{};
+            fd.fd = ConnectionNumber(display());
+            fd.events = POLLIN;
+            auto timeout = std::min(time_left, EVENTS_POLL_INTERVAL);
+            if (poll(&fd, 1, static_cast<int>(timeout.count())) < 0) {
+                std::this_thread::sleep_until(deadline);
+                return false;
+            }
         }
-        return is_supported_.value();
     }
 
-    AutoTypeResult key_move(Direction direction, os_key_code_t code) {
+    // Waits until the state of modifiers changes, but not longer than timeout
+    void wait_for_modifiers_change(std::chrono::milliseconds timeout) {
+        if (!display() || !is_supported()) {
+            std::this_thread::sleep_for(timeout);
+            return;
+        }
+        select_xkb_events();
+
+        auto modifier_changes = modifier_changes_;
+        wait_for_events(std::chrono::steady_clock::now() + timeout,
+                        [&] { return modifier_changes_ != modifier_changes; });
+    }
+
+    // Returns the keyboard state without a round trip, the server is queried only once,
+    // after this the state is updated from events
+    std::optional<KeyboardState> keyboard_state() {
+        if (!is_supported()) {
+            return std::nullopt;
+        }
+        select_xkb_events();
+        process_pending_events();
+        if (!keyboard_state_.has_value()) {
+            XkbStateRec kbd_state{};
+            if (XkbGetState(display(), XkbUseCoreKbd, &kbd_state)) {
+                return std::nullopt;
+            }
+            KeyboardState state{};
+            state.group = kbd_state.group;
+            state.locked_mods = kbd_state.locked_mods;
+            state.base_mods = kbd_state.base_mods;
+            keyboard_state_ = state;
+        }
+        return keyboard_state_;
+    }
+
+    const std::array<uint8_t, KEY_CODES_MODIFIERS.size()> &modifier_key_codes() {
+        if (!modifier_key_codes_.has_value()) {
+            std::array<uint8_t, KEY_CODES_MODIFIERS.size()> key_codes{};
+            for (size_t i = 0; i < KEY_CODES_MODIFIERS.size(); i++) {
+                key_codes.at(i) = XKeysymToKeycode(display(), KEY_CODES_MODIFIERS.at(i).first);
+            }
+            modifier_key_codes_ = key_codes;
+        }
+        return modifier_key_codes_.value();
+    }
+
+    AutoTypeResult key_move(Direction direction, os_key_code_t code, char32_t character,
+                            uint32_t native_key = 0) {
         if (!code) {
             return throw_or_return(AutoTypeResult::BadArg, "Empty key code");
         }
@@ -110,20 +289,54 @@ class AutoType::AutoTypeImpl {
             return throw_or_return(AutoTypeResult::NotSupported, "Not supported");
         }
 
-        if (!in_batch_text_entry_ || !active_keyboard_group_.has_value()) {
+        if (!in_batch_text_entry_ || !keyboard_layout_) {
             read_keyboard_layout();
         }
-        if (!active_keyboard_group_.has_value()) {
+        if (!keyboard_layout_) {
             return throw_or_return(AutoTypeResult::OsError, "Keyboard layout was not read");
         }
 
-        auto layout_entry = keyboard_layout_.find(code);
+        if (!in_batch_text_entry_) {
+            // outside of a batch, each event is checked synchronously
+            auto tx = begin_batch_text_entry();
+            auto result = queue_key_move(direction, code, character, native_key);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+            return flush();
+        }
+
+        auto result = queue_key_move(direction, code, character, native_key);
+        if (result != AutoTypeResult::Ok) {
+            return result;
+        }
+        if (batch_flush_chunk_size_ &&
+            pending_key_events_.size() % batch_flush_chunk_size_ == 0) {
+            // send the queued events without waiting for the server to process them
+            XFlush(display());
+        }
+        return AutoTypeResult::Ok;
+    }
+
+    AutoTypeResult queue_key_move(Direction direction, os_key_code_t code, char32_t character,
+                                  uint32_t native_key) {
         KeyCodeWithMask key{};
-        KeySym key_sym_lower = 0;
-        KeySym key_sym_upper = 0;
-        XConvertCase(code, &key_sym_lower, &key_sym_upper);
-        if (layout_entry == keyboard_layout_.end()) {
+        if (native_key) {
+            // resolved in advance by TypingProgram
+            key = unpack_native_key(native_key);
+        } else if (const auto *layout_key = find_layout_key(code)) {
+            key = *layout_key;
+        } else if (const auto *scratch_key = scratch_group_keys_.find(code)) {
+            key = *scratch_key;
+        } else if (auto extra_key = key_code_from_extra_key_mapping(code); extra_key.has_value()) {
+            key = extra_key.value();
+        } else {
             if (is_valid_key_sym(code)) {
+                // queued events may still use the reused key, make sure they are processed
+                auto result = flush();
+                if (result != AutoTypeResult::Ok) {
+                    return result;
+                }
                 key = add_extra_key_mapping(code);
                 if (!key.key_code) {
                     return throw_or_return(AutoTypeResult::OsError, "Failed to add key mapping");
@@ -132,148 +345,572 @@ class AutoType::AutoTypeImpl {
                 return throw_or_return(AutoTypeResult::BadArg,
                                        std::string("Bad key code: ") + std::to_string(code));
             }
-        } else {
-            key = layout_entry->second;
         }
 
         auto down = direction == Direction::Down;
 
-        if (key.group != active_keyboard_group_.value()) {
+        PendingKeyEvent pending_event{};
+        pending_event.serial = NextRequest(display());
+        pending_event.character = character;
+        pending_event.key_sym = code;
+        pending_key_events_.push_back(pending_event);
+
+        // the group and locked modifiers don't matter for key up events and modifier keys
+        if (down && !is_modifier_key_sym(code)) {
+            auto result = switch_keyboard_state(key);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+        }
+
+        if (!XTestFakeKeyEvent(display(), key.key_code, down, CurrentTime)) {
+            return throw_or_return(AutoTypeResult::OsError, "Failed to send key event");
+        }
+
+        return AutoTypeResult::Ok;
+    }
+
+    // Locks the group and modifiers needed for the key, they stay locked for the next keys
+    // and are restored at the end of the transaction, so that a run of characters
+    // from another group costs one switch instead of two for each character
+    AutoTypeResult switch_keyboard_state(const KeyCodeWithMask &key) {
+        if (key.group != locked_group_.value_or(keyboard_layout_->group)) {
             if (!XkbLockGroup(display(), XkbUseCoreKbd, key.group)) {
                 return throw_or_return(AutoTypeResult::OsError, "Failed to change keyboard layout");
             }
+            locked_group_ = key.group;
+            stats_.state_changes++;
         }
-        XkbStateRec kbd_state{};
-        if (key.mod_mask) {
-            if (XkbGetState(display(), XkbUseCoreKbd, &kbd_state)) {
+
+        auto locked_mods_changed =
+            original_locked_mods_.has_value() && locked_mods_ != original_locked_mods_.value();
+        if (!key.mod_mask && !locked_mods_changed) {
+            return AutoTypeResult::Ok;
+        }
+        if (!original_locked_mods_.has_value()) {
+            auto kbd_state = keyboard_state();
+            if (!kbd_state.has_value()) {
                 return throw_or_return(AutoTypeResult::OsError, "Failed to get modifiers state");
             }
-            if (kbd_state.locked_mods != key.mod_mask) {
-                if (!XkbLockModifiers(display(), XkbUseCoreKbd, key.mod_mask, key.mod_mask)) {
-                    return throw_or_return(AutoTypeResult::OsError, "Failed to lock modifiers");
-                }
+            original_locked_mods_ = kbd_state->locked_mods;
+            locked_mods_ = kbd_state->locked_mods;
+        }
+
+        uint8_t wanted_mods = original_locked_mods_.value() | key.mod_mask;
+        if (locked_mods_ != wanted_mods) {
+            auto affected_mods = locked_mods_ ^ wanted_mods;
+            if (!XkbLockModifiers(display(), XkbUseCoreKbd, affected_mods,
+                                  wanted_mods & affected_mods)) {
+                return throw_or_return(AutoTypeResult::OsError, "Failed to lock modifiers");
             }
+            locked_mods_ = wanted_mods;
+            stats_.state_changes++;
         }
 
-        if (!XTestFakeKeyEvent(display(), key.key_code, down, CurrentTime)) {
-            return throw_or_return(AutoTypeResult::OsError, "Failed to send key event");
+        return AutoTypeResult::Ok;
+    }
+
+    void restore_keyboard_state() {
+        auto restored = false;
+        if (original_locked_mods_.has_value() && locked_mods_ != original_locked_mods_.value()) {
+            auto affected_mods = locked_mods_ ^ original_locked_mods_.value();
+            XkbLockModifiers(display(), XkbUseCoreKbd, affected_mods,
+                             original_locked_mods_.value() & affected_mods);
+            stats_.state_changes++;
+            restored = true;
+        }
+        if (locked_group_.has_value() && keyboard_layout_ &&
+            locked_group_ != keyboard_layout_->group) {
+            XkbLockGroup(display(), XkbUseCoreKbd, keyboard_layout_->group);
+            stats_.state_changes++;
+            restored = true;
         }
+        original_locked_mods_.reset();
+        locked_group_.reset();
 
-        if (key.mod_mask && kbd_state.locked_mods != key.mod_mask) {
-            auto values = kbd_state.locked_mods & key.mod_mask;
-            if (!XkbLockModifiers(display(), XkbUseCoreKbd, key.mod_mask, values)) {
-                return throw_or_return(AutoTypeResult::OsError, "Failed to unlock modifiers");
-            }
+        if (restored) {
+            // after this, state events caused by us are received and the mirror is up to date
+            XSync(display(), False);
         }
-        if (key.group != active_keyboard_group_.value()) {
-            if (!XkbLockGroup(display(), XkbUseCoreKbd, active_keyboard_group_.value())) {
-                return throw_or_return(AutoTypeResult::OsError,
-                                       "Failed to restore keyboard layout");
+    }
+
+    static bool is_modifier_key_sym(KeySym key_sym) {
+        return std::any_of(KEY_CODES_MODIFIERS.begin(), KEY_CODES_MODIFIERS.end(),
+                           [=](const auto &modifier) {
+                               return static_cast<KeySym>(modifier.first) == key_sym;
+                           });
+    }
+
+    AutoTypeResult flush() {
+        if (pending_key_events_.empty()) {
+            return AutoTypeResult::Ok;
+        }
+
+        // one round trip for all queued events instead of one per event
+        XSync(display(), False);
+        stats_.round_trips_saved += pending_key_events_.size() - 1;
+
+        // errors of requests sent by other instances on the shared connection are left to them
+        auto error = connection_->take_error(pending_key_events_.front().serial,
+                                             pending_key_events_.back().serial);
+        if (!error.has_value()) {
+            pending_key_events_.clear();
+            return AutoTypeResult::Ok;
+        }
+
+        // serials are increasing, the failed event is the last one sent before the error
+        auto failed_event = std::find_if(
+            pending_key_events_.rbegin(), pending_key_events_.rend(),
+            [serial = error->serial](const auto &event) { return event.serial <= serial; });
+
+        auto message = std::string("Failed to send key event, X11 error ") +
+                       std::to_string(error->error_code);
+        if (failed_event != pending_key_events_.rend()) {
+            if (failed_event->character) {
+                message += std::string(" on character ") +
+                           std::to_string(static_cast<uint32_t>(failed_event->character));
+            } else {
+                message += std::string(" on key sym ") + std::to_string(failed_event->key_sym);
             }
         }
+        pending_key_events_.clear();
+
+        return throw_or_return(AutoTypeResult::OsError, message);
+    }
 
+    // Waits until the requests are processed, returns the first error caused by the requests
+    // sent by us since first_serial
+    std::optional<X11Error>
+    sync_and_take_error(unsigned long first_serial) { // NOLINT(google-runtime-int)
         XSync(display(), False);
-        return AutoTypeResult::Ok;
+        return connection_->take_error(first_serial, NextRequest(display()) - 1);
+    }
+
+    void discard_pending_key_events() {
+        if (pending_key_events_.empty()) {
+            return;
+        }
+        XSync(display(), False);
+        [[maybe_unused]] auto error = connection_->take_error(pending_key_events_.front().serial,
+                                                              pending_key_events_.back().serial);
+        pending_key_events_.clear();
     }
 
+    // Runs requests which can fail, for example, if the window has gone meanwhile, their errors
+    // are ignored, but taken from the shared connection, so that they're not left in its log
+    template <typename Fn> auto ignoring_errors(Fn fn) {
+        std::lock_guard lock(connection_->transaction_mutex());
+        X11ErrorTrap error_trap;
+        auto first_serial = NextRequest(display());
+        auto result = fn();
+        [[maybe_unused]] auto error = sync_and_take_error(first_serial);
+        return result;
+    }
+
+    void set_batch_flush_chunk_size(size_t key_events) { batch_flush_chunk_size_ = key_events; }
+
     void read_keyboard_layout() {
         if (!is_supported()) {
             return;
         }
-
-        XkbStateRec kbd_state;
-        if (XkbGetState(display(), XkbUseCoreKbd, &kbd_state)) {
+        if (in_batch_text_entry_ && keyboard_layout_) {
+            // the layout is kept until the end of the transaction,
+            // groups switched by us while typing must not change it
             return;
         }
-        auto active_group = kbd_state.group;
-        if (active_group == active_keyboard_group_) {
+
+        auto kbd_state = keyboard_state();
+        if (!kbd_state.has_value()) {
             return;
         }
 
-        keyboard_layout_.clear();
+        auto layout = layout_watcher_->layout();
+        if (layout && layout->group != kbd_state->group) {
+            layout = layout_watcher_->switch_group(kbd_state->group);
+        }
+        if (!layout) {
+            // the watcher hasn't read it yet, this happens on the first call or just after
+            // the group has been switched, our state mirror knows about it earlier
+            // the keymap can change while it's being read, then it's read again
+            for (auto attempt = 0; attempt < MAX_LAYOUT_READ_ATTEMPTS && !layout; attempt++) {
+                auto keymap_serial = layout_watcher_->keymap_serial();
+                auto new_layout =
+                    x11_read_keyboard_layout(display(), kbd_state->group, reserved_keys());
+                if (!new_layout) {
+                    return;
+                }
+                layout = layout_watcher_->publish(std::move(new_layout), keymap_serial);
+            }
+            if (!layout) {
+                return;
+            }
+        }
+        keyboard_layout_ = std::move(layout);
+    }
+
+    // Keys of a layout taken from a snapshot are checked against the server when they're used
+    // for the first time, if one of them has changed, the layout is read from the keymap again,
+    // the watcher saves it over the stale snapshot
+    // Returns false if the layout has been replaced, keys found before must be looked up again
+    bool check_layout_keys(uint8_t first_key_code, uint8_t last_key_code) {
+        // the previous layout keeps its mapped tables until we return
+        auto layout = keyboard_layout_;
+        if (!layout || !layout->snapshot) {
+            return true;
+        }
+
+        std::lock_guard lock(connection_->transaction_mutex());
+        auto matches = false;
+        {
+            X11ErrorTrap error_trap;
+            auto first_serial = NextRequest(display());
+            matches = x11_check_snapshot_keys(display(), *layout->snapshot, first_key_code,
+                                              last_key_code, reserved_keys());
+            // the last request had a reply, all errors have been received before it
+            [[maybe_unused]] auto error =
+                connection_->take_error(first_serial, NextRequest(display()) - 1);
+        }
+        if (matches) {
+            return true;
+        }
+
+        // the group of the layout, not the current one, we may have switched it while typing
+        auto keymap_serial = layout_watcher_->keymap_serial();
+        auto new_layout =
+            x11_read_keyboard_layout(display(), layout->group, reserved_keys(), false);
+        if (!new_layout) {
+            return true;
+        }
+        auto published = layout_watcher_->publish(new_layout, keymap_serial);
+        // if the keymap has changed meanwhile, the new layout is still better than the snapshot
+        keyboard_layout_ = published ? std::move(published) : std::move(new_layout);
+        return false;
+    }
+
+    // Checks the keys of the characters found in the layout with one request for all of them
+    bool check_layout_keys(const PackedKeyCode *keys, size_t keys_size) {
+        if (!keyboard_layout_ || !keyboard_layout_->snapshot) {
+            return true;
+        }
+        uint8_t first_key_code = UINT8_MAX;
+        uint8_t last_key_code = 0;
+        for (size_t i = 0; i < keys_size; i++) {
+            auto key = keys[i]; // NOLINT(*-pointer-arithmetic)
+            if (!key.has_value()) {
+                continue;
+            }
+            const auto *layout_key = keyboard_layout_->find(static_cast<KeySym>(key.code()));
+            if (layout_key && !is_checked_layout_key(layout_key->key_code)) {
+                first_key_code = std::min(first_key_code, layout_key->key_code);
+                last_key_code = std::max(last_key_code, layout_key->key_code);
+            }
+        }
+        if (first_key_code > last_key_code) {
+            return true;
+        }
+        return check_layout_keys(first_key_code, last_key_code);
+    }
+
+    bool is_checked_layout_key(uint8_t key_code) const {
+        return !keyboard_layout_->snapshot || keyboard_layout_->snapshot->is_checked(key_code);
+    }
+
+    // Looks up the key in the layout, it's checked first if the layout is taken from a snapshot
+    const KeyCodeWithMask *find_layout_key(KeySym key_sym) {
+        const auto *key = keyboard_layout_->find(key_sym);
+        if (key && !is_checked_layout_key(key->key_code) &&
+            !check_layout_keys(key->key_code, key->key_code)) {
+            key = keyboard_layout_->find(key_sym);
+        }
+        return key;
+    }
+
+    // Maps all key syms missing in the layout at once, each to its own key code,
+    // so that we wait for the mapping to propagate only once for the whole text
+    AutoTypeResult add_extra_key_mappings(const PackedKeyCode *keys, size_t keys_size) {
+        if (!display() || !is_supported()) {
+            // reported on the first key event
+            return AutoTypeResult::Ok;
+        }
+        read_keyboard_layout();
+        if (!keyboard_layout_) {
+            return AutoTypeResult::Ok;
+        }
+        // keys found in the layout are typed as they are, so they're checked now, not one by one
+        check_layout_keys(keys, keys_size);
+
+        if (use_scratch_keyboard_group_) {
+            auto result = add_scratch_keyboard_group(keys, keys_size);
+            if (result != AutoTypeResult::Ok) {
+                return result;
+            }
+        }
 
-        auto kbd_components = XkbCompatMapMask | XkbGeometryMask;
-        auto *kbd = XkbGetKeyboard(display(), kbd_components, XkbUseCoreKbd);
+        auto first_new_mapping = extra_key_mappings_.size();
+        for (size_t i = 0; i < keys_size; i++) {
+            auto key = keys[i]; // NOLINT(*-pointer-arithmetic)
+            if (!key.has_value()) {
+                continue;
+            }
+            auto key_sym = static_cast<KeySym>(key.code());
+            if (!is_valid_key_sym(key_sym) || keyboard_layout_->contains(key_sym) ||
+                scratch_group_keys_.contains(key_sym) ||
+                key_code_from_extra_key_mapping(key_sym).has_value()) {
+                continue;
+            }
+            auto key_code = reserve_free_extra_key_code();
+            if (!key_code.has_value()) {
+                // the rest is mapped one by one while typing, reusing these key codes
+                break;
+            }
+            extra_key_mappings_.push_back({key_code.value(), key_sym});
+        }
+        if (extra_key_mappings_.size() == first_new_mapping) {
+            return AutoTypeResult::Ok;
+        }
+
+        std::vector<X11KeyMapping> new_mappings(
+            extra_key_mappings_.begin() + static_cast<ptrdiff_t>(first_new_mapping),
+            extra_key_mappings_.end());
+        auto first_serial = NextRequest(display());
+        change_key_mappings(new_mappings);
+        if (sync_and_take_error(first_serial).has_value()) {
+            extra_key_mappings_.resize(first_new_mapping);
+            return throw_or_return(AutoTypeResult::OsError, "Failed to add key mapping");
+        }
+        wait_for_key_mapping_propagation();
+
+        return AutoTypeResult::Ok;
+    }
+
+    // Instead of remapping keys, adds one more keyboard group to the keys which have all groups
+    // and puts the missing key syms there, it's one request no matter how many key syms we need
+    AutoTypeResult add_scratch_keyboard_group(const PackedKeyCode *keys, size_t keys_size) {
+        std::vector<KeySym> key_syms;
+        for (size_t i = 0; i < keys_size; i++) {
+            auto key = keys[i]; // NOLINT(*-pointer-arithmetic)
+            if (!key.has_value()) {
+                continue;
+            }
+            auto key_sym = static_cast<KeySym>(key.code());
+            if (is_valid_key_sym(key_sym) && !keyboard_layout_->contains(key_sym) &&
+                !scratch_group_keys_.contains(key_sym) &&
+                std::find(key_syms.begin(), key_syms.end(), key_sym) == key_syms.end()) {
+                key_syms.push_back(key_sym);
+            }
+        }
+        if (key_syms.empty() || !scratch_group_keys_.empty()) {
+            // the group is installed once per transaction, the rest is remapped
+            return AutoTypeResult::Ok;
+        }
+
+        auto kbd_components = XkbKeyTypesMask | XkbKeySymsMask;
+        auto *kbd = XkbGetMap(display(), kbd_components, XkbUseCoreKbd);
         if (!kbd) {
-            return;
+            return AutoTypeResult::Ok;
         }
 
+        auto groups_num = 0;
         for (uint16_t key_code = kbd->min_key_code; key_code <= kbd->max_key_code; key_code++) {
-            if (key_code == empty_key_code_) {
+            groups_num = std::max(groups_num, static_cast<int>(XkbKeyNumGroups(kbd, key_code)));
+        }
+        if (!groups_num || groups_num >= XkbNumKbdGroups) {
+            // all groups are taken, we'll remap keys instead
+            XkbFreeKeyboard(kbd, kbd_components, True);
+            return AutoTypeResult::Ok;
+        }
+        auto scratch_group = groups_num;
+
+        XkbMapChangesRec changes{};
+        auto next_key_sym = key_syms.begin();
+        for (uint16_t key_code = kbd->min_key_code;
+             key_code <= kbd->max_key_code && next_key_sym != key_syms.end(); key_code++) {
+            if (XkbKeyNumGroups(kbd, key_code) != groups_num) {
                 continue;
             }
-            auto key_groups_num = XkbKeyNumGroups(kbd, key_code);
-            auto is_empty = true;
-            for (auto group = 0; group < key_groups_num; group++) {
-                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-constant-array-index)
-                auto shift_levels_count = XkbKeyGroupWidth(kbd, key_code, group);
-                if (shift_levels_count > 1) {
-                    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-constant-array-index)
-                    auto *key_type = XkbKeyKeyType(kbd, key_code, group);
-                    if (key_type->map_count > 0 && key_type->map[0].mods.mask == ShiftMask) {
-                        // for most of keys we consider two states
-                        shift_levels_count = 2;
-                    } else {
-                        // all other modifiers are ignored for now
-                        shift_levels_count = 1;
-                    }
-                }
-                for (auto shift_level = 0; shift_level < shift_levels_count; shift_level++) {
-                    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-                    auto sym = XkbKeySymEntry(kbd, key_code, shift_level, group);
-                    if (sym) {
-                        auto existing_mapping = keyboard_layout_.find(sym);
-                        if (existing_mapping != keyboard_layout_.end()) {
-                            // active group always has priority
-                            // so that we press "heZ" in German layout to get "heY"
-                            if (group != active_group) {
-                                continue;
-                            }
-                            // inside the active group, the first key has priority
-                            if (existing_mapping->second.group == active_group) {
-                                continue;
-                            }
-                        }
-                        KeyCodeWithMask kc{};
-                        kc.key_code = key_code;
-                        kc.group = group;
-                        if (shift_level > 0) {
-                            kc.mod_mask = ShiftMask;
-                        }
-                        keyboard_layout_.insert_or_assign(sym, kc);
-                    }
-                    if (sym) {
-                        is_empty = false;
-                    }
-                }
+            std::array<int, XkbNumKbdGroups> key_types{};
+            for (auto group = 0; group < groups_num; group++) {
+                key_types.at(group) = XkbKeyKeyTypeIndex(kbd, key_code, group);
             }
-            if (is_empty && !empty_key_code_) {
-                empty_key_code_ = key_code;
+            key_types.at(scratch_group) = XkbOneLevelIndex;
+            auto changed_groups = XkbGroup1Mask << scratch_group;
+            if (XkbChangeTypesOfKey(kbd, key_code, scratch_group + 1, changed_groups,
+                                    key_types.data(), &changes) != Success) {
+                continue;
             }
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            XkbKeySymEntry(kbd, key_code, 0, scratch_group) = *next_key_sym;
+
+            KeyCodeWithMask key{};
+            key.key_code = key_code;
+            key.group = scratch_group;
+            scratch_group_keys_.insert_or_assign(*next_key_sym, key);
+            next_key_sym++;
         }
 
-        active_keyboard_group_ = active_group;
-
+        if (!scratch_group_keys_.empty()) {
+            reserved_keys().reserve_group(scratch_group);
+            key_mapping_serial_ = NextRequest(display());
+            XkbChangeMap(display(), kbd, &changes);
+        }
         XkbFreeKeyboard(kbd, kbd_components, True);
+        if (scratch_group_keys_.empty()) {
+            return AutoTypeResult::Ok;
+        }
+
+        if (sync_and_take_error(key_mapping_serial_).has_value()) {
+            scratch_group_keys_.clear();
+            return throw_or_return(AutoTypeResult::OsError, "Failed to add keyboard group");
+        }
+        wait_for_key_mapping_propagation();
+
+        return AutoTypeResult::Ok;
+    }
+
+    void remove_scratch_keyboard_group() {
+        if (scratch_group_keys_.empty()) {
+            return;
+        }
+
+        // The keys have been just used, let the app process them
+        wait_for_key_mapping_propagation();
+
+        auto kbd_components = XkbKeyTypesMask | XkbKeySymsMask;
+        auto *kbd = XkbGetMap(display(), kbd_components, XkbUseCoreKbd);
+        if (kbd) {
+            XkbMapChangesRec changes{};
+            scratch_group_keys_.for_each([&](KeySym, const KeyCodeWithMask &key) {
+                if (XkbKeyNumGroups(kbd, key.key_code) != key.group + 1) {
+                    return;
+                }
+                std::array<int, XkbNumKbdGroups> key_types{};
+                for (auto group = 0; group < key.group; group++) {
+                    key_types.at(group) = XkbKeyKeyTypeIndex(kbd, key.key_code, group);
+                }
+                XkbChangeTypesOfKey(kbd, key.key_code, key.group, XkbGroup1Mask, key_types.data(),
+                                    &changes);
+            });
+            key_mapping_serial_ = NextRequest(display());
+            XkbChangeMap(display(), kbd, &changes);
+            XSync(display(), False);
+            XkbFreeKeyboard(kbd, kbd_components, True);
+        }
+
+        reserved_keys().release_group();
+        scratch_group_keys_.clear();
+    }
+
+    void set_use_scratch_keyboard_group(bool use_scratch_keyboard_group) {
+        use_scratch_keyboard_group_ = use_scratch_keyboard_group;
     }
 
     KeyCodeWithMask add_extra_key_mapping(KeySym key_sym) {
-        if (!empty_key_code_) {
+        auto key_code = reserve_free_extra_key_code();
+        if (!key_code.has_value()) {
+            if (extra_key_mappings_.empty()) {
+                return {};
+            }
+            // all empty key codes are taken, reuse the one mapped first, it stays reserved
+            wait_for_key_mapping_propagation();
+            key_code = extra_key_mappings_.front().key_code;
+            extra_key_mappings_.erase(extra_key_mappings_.begin());
+        }
+        key_mapping_serial_ = NextRequest(display());
+        if (XChangeKeyboardMapping(display(), key_code.value(), 1, &key_sym, 1)) {
+            reserved_keys().release_key_code(key_code.value());
             return {};
         }
-        if (empty_key_code_key_sym_ != key_sym) {
-            if (empty_key_code_key_sym_) {
-                wait_for_key_mapping_propagation();
+        XSync(display(), False);
+        wait_for_key_mapping_propagation();
+
+        extra_key_mappings_.push_back({key_code.value(), key_sym});
+
+        return extra_key(key_code.value(), key_sym);
+    }
+
+    void remove_extra_key_mappings() {
+        if (extra_key_mappings_.empty()) {
+            return;
+        }
+
+        // The keys have been just used, let the app process them
+        wait_for_key_mapping_propagation();
+
+        for (auto &mapping : extra_key_mappings_) {
+            mapping.key_sym = 0;
+        }
+        change_key_mappings(extra_key_mappings_);
+        XSync(display(), False);
+
+        for (const auto &mapping : extra_key_mappings_) {
+            reserved_keys().release_key_code(mapping.key_code);
+        }
+        extra_key_mappings_.clear();
+    }
+
+    void change_key_mappings(const std::vector<X11KeyMapping> &mappings) {
+        x11_change_key_mappings(display(), mappings);
+        key_mapping_serial_ = NextRequest(display()) - 1;
+    }
+
+    void reclaim_extra_key_mappings() {
+        if (!connection_) {
+            return;
+        }
+        auto idle_mappings = connection_->key_mapping_reaper().take();
+        extra_key_mappings_.insert(extra_key_mappings_.end(), idle_mappings.begin(),
+                                   idle_mappings.end());
+    }
+
+    void release_extra_key_mappings() {
+        if (key_mapping_idle_time_.count() <= 0) {
+            remove_extra_key_mappings();
+            return;
+        }
+        if (extra_key_mappings_.empty()) {
+            return;
+        }
+        connection_->key_mapping_reaper().put(extra_key_mappings_, key_mapping_idle_time_);
+        extra_key_mappings_.clear();
+    }
+
+    void set_key_mapping_idle_time(std::chrono::milliseconds time) {
+        key_mapping_idle_time_ = time;
+    }
+
+    // Empty key codes are shared by all instances, ours are reserved as well
+    std::optional<uint8_t> reserve_free_extra_key_code() {
+        auto layout = keyboard_layout_;
+        if (!layout) {
+            return std::nullopt;
+        }
+        for (auto key_code : layout->empty_key_codes) {
+            if (reserved_keys().is_reserved_key_code(key_code)) {
+                continue;
             }
-            if (XChangeKeyboardMapping(display(), empty_key_code_, 1, &key_sym, 1)) {
-                return {};
+            if (!is_checked_layout_key(key_code) && !check_layout_keys(key_code, key_code)) {
+                // the key is not empty anymore, the new layout has other empty key codes
+                return reserve_free_extra_key_code();
+            }
+            if (reserved_keys().try_reserve_key_code(key_code)) {
+                return key_code;
             }
-            XSync(display(), False);
-            wait_for_key_mapping_propagation();
         }
+        return std::nullopt;
+    }
+
+    std::optional<KeyCodeWithMask> key_code_from_extra_key_mapping(KeySym key_sym) {
+        for (const auto &mapping : extra_key_mappings_) {
+            if (mapping.key_sym == key_sym) {
+                return extra_key(mapping.key_code, key_sym);
+            }
+        }
+        return std::nullopt;
+    }
 
+    static KeyCodeWithMask extra_key(uint8_t key_code, KeySym key_sym) {
         KeyCodeWithMask key{};
-        key.key_code = empty_key_code_;
+        key.key_code = key_code;
 
         KeySym key_sym_lower = 0;
         KeySym key_sym_upper = 0;
@@ -283,51 +920,140 @@ class AutoType::AutoTypeImpl {
             key.mod_mask = ShiftMask;
         }
 
-        empty_key_code_key_sym_ = key_sym;
-
         return key;
     }
 
-    void remove_extra_key_mapping() {
-        if (!empty_key_code_ || !empty_key_code_key_sym_) {
-            return;
+    void wait_for_key_mapping_propagation() {
+        // This is called:
+        // 1. between adding a new key mapping and its usage
+        // 2. after using and before removing a key mapping
+        // We need this delay to make sure the target app has processesed the remapping event.
+        // The server sends MappingNotify to all apps at the same time, so once we have got it,
+        // a ping reply from the app means that it has processed everything sent before.
+        // If the app doesn't reply, we wait for the fixed delay.
+        auto started = std::chrono::steady_clock::now();
+        auto deadline = started + KEY_MAPPING_PROPAGATION_DELAY;
+
+        auto confirmed = wait_for_events(
+            deadline, [this] { return mapping_notify_serial_ >= key_mapping_serial_; });
+        confirmed = confirmed && ping_active_window(deadline);
+        if (!confirmed) {
+            std::this_thread::sleep_until(deadline);
         }
 
-        // The key has been just used, let the app process it
-        wait_for_key_mapping_propagation();
+        stats_.key_mapping_wait_time += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started);
+    }
 
-        KeySym key_sym = 0;
-        XChangeKeyboardMapping(display(), empty_key_code_, 1, &key_sym, 1);
-        XSync(display(), False);
+    bool ping_active_window(std::chrono::steady_clock::time_point deadline) {
+        // the root window event mask is shared by all instances, it's changed only under the lock
+        std::lock_guard lock(connection_->transaction_mutex());
+        // pending key events are already synced here, errors are only about the window
+        X11ErrorTrap error_trap;
+        auto first_serial = NextRequest(display());
 
-        empty_key_code_key_sym_ = 0;
-    }
+        auto window = x11_get_active_window(display());
+        if (!window || !x11_window_supports_protocol(display(), window, "_NET_WM_PING")) {
+            [[maybe_unused]] auto error = sync_and_take_error(first_serial);
+            return false;
+        }
+        if (!wm_protocols_atom_) {
+            wm_protocols_atom_ = XInternAtom(display(), "WM_PROTOCOLS", False);
+            net_wm_ping_atom_ = XInternAtom(display(), "_NET_WM_PING", False);
+        }
 
-    void wait_for_key_mapping_propagation() {
-        // This is called:
-        // 1. between adding a new key mapping and its usage
-        // 2. after using and before removing a key mapping
-        // We need this delay to make sure the target app has processesed the remapping event
-        std::this_thread::sleep_for(KEY_MAPPING_PROPAGATION_DELAY);
+        // the reply is sent to the root window, we can receive it without being a window manager
+        // the mask is selected for the whole connection, so the previous one is restored after
+        auto root = XDefaultRootWindow(display());
+        XWindowAttributes root_attr{};
+        if (!XGetWindowAttributes(display(), root, &root_attr)) {
+            [[maybe_unused]] auto error = sync_and_take_error(first_serial);
+            return false;
+        }
+        auto root_event_mask = root_attr.your_event_mask;
+        if (!(root_event_mask & SubstructureNotifyMask)) {
+            XSelectInput(display(), root, root_event_mask | SubstructureNotifyMask);
+        }
+
+        // replies are copied to all instances of the connection, so the ping must be unique
+        static std::atomic<Time> last_ping = 0;
+        auto ping = ++last_ping;
+        auto replied = x11_send_ping(display(), window, ping);
+        if (replied) {
+            XFlush(display());
+            replied = wait_for_events(deadline, [&] { return ping_reply_ == ping; });
+        }
+
+        if (!(root_event_mask & SubstructureNotifyMask)) {
+            XSelectInput(display(), root, root_event_mask);
+        }
+        if (sync_and_take_error(first_serial).has_value()) {
+            return false;
+        }
+        return replied;
     }
 
     std::optional<KeyCodeWithMask> key_code_from_layout(KeySym key_sym) {
-        auto found = keyboard_layout_.find(key_sym);
-        if (found == keyboard_layout_.end()) {
+        if (!keyboard_layout_) {
+            return std::nullopt;
+        }
+        const auto *found = find_layout_key(key_sym);
+        if (!found) {
             return std::nullopt;
         }
-        return found->second;
+        return *found;
+    }
+
+    // During a transaction the layout snapshot doesn't change and looking up keys in it
+    // doesn't use the display, so it can be done on another thread while we're typing
+    // The thread gets its own reference to the layout and never touches this instance
+    std::shared_ptr<const X11KeyboardLayout> background_keyboard_layout() const {
+        return in_batch_text_entry_ ? keyboard_layout_ : nullptr;
+    }
+
+    uint64_t layout_generation() const {
+        return keyboard_layout_ ? keyboard_layout_->generation : 0;
+    }
+
+    uint32_t native_key(KeySym key_sym) {
+        auto key = key_code_from_layout(key_sym);
+        if (!key.has_value()) {
+            return 0;
+        }
+        return key->key_code | static_cast<uint32_t>(key->group) << NATIVE_KEY_GROUP_SHIFT |
+               static_cast<uint32_t>(key->mod_mask) << NATIVE_KEY_MOD_MASK_SHIFT;
+    }
+
+    static KeyCodeWithMask unpack_native_key(uint32_t native_key) {
+        KeyCodeWithMask key{};
+        key.key_code = native_key & NATIVE_KEY_BYTE_MASK;
+        key.group = (native_key >> NATIVE_KEY_GROUP_SHIFT) & NATIVE_KEY_BYTE_MASK;
+        key.mod_mask = (native_key >> NATIVE_KEY_MOD_MASK_SHIFT) & NATIVE_KEY_BYTE_MASK;
+        return key;
     }
 
     std::optional<KeyCodeWithModifiers> os_key_code_from_char(char32_t character) {
-        auto key_sym = char_to_keysym(character);
+        return os_key_code_from_key_sym(char_to_keysym(character));
+    }
+
+    std::optional<KeyCodeWithModifiers> os_key_code_from_key_sym(KeySym key_sym) {
+        return os_key_code_from_key_sym(keyboard_layout_.get(), key_sym);
+    }
+
+    // found is set to false if the key sym is valid, but missing in the layout
+    static std::optional<KeyCodeWithModifiers>
+    os_key_code_from_key_sym(const X11KeyboardLayout *layout, KeySym key_sym,
+                             bool *found = nullptr) {
         if (!key_sym || !is_valid_key_sym(key_sym)) {
             return std::nullopt;
         }
         KeyCodeWithModifiers kc{};
         kc.code = key_sym;
-        auto layout_key = key_code_from_layout(key_sym);
-        auto mod_mask = layout_key.has_value() ? layout_key->mod_mask : 0;
+        const auto *layout_key = layout ? layout->find(key_sym) : nullptr;
+        if (found) {
+            *found = layout_key != nullptr;
+        }
+        auto mod_mask = layout_key ? layout_key->mod_mask : 0;
         if (mod_mask) {
             for (auto [mask, modifier] : OS_KEY_CODE_SUPPORTED_MODIFIERS_MASKS) {
                 if (mod_mask & mask) {
@@ -338,27 +1064,62 @@ class AutoType::AutoTypeImpl {
         return kc;
     }
 
-    bool is_valid_key_sym(KeySym key_sym) {
+    static bool is_valid_key_sym(KeySym key_sym) {
         // this can be better checked with XKeysymToString but the leak detector says
         // it still leaks if it's called with valid Unocide code points not defined as KeySym
         // see https://bugs.freedesktop.org/show_bug.cgi?id=7100
         return key_sym > 0 && key_sym <= MAX_KEYSYM;
     }
 
+    AutoTypeResult warm_up(bool init_browser_url) {
+        if (!display()) {
+            return throw_or_return(AutoTypeResult::OsError, "Cannot open display");
+        }
+        if (!is_supported()) {
+            return throw_or_return(AutoTypeResult::NotSupported, "Not supported");
+        }
+        select_xkb_events();
+        read_keyboard_layout();
+        if (!keyboard_layout_) {
+            return throw_or_return(AutoTypeResult::OsError, "Keyboard layout was not read");
+        }
+        // other groups are built on the first miss otherwise, usually in the middle of a text
+        [[maybe_unused]] const auto &inactive_keys = keyboard_layout_->inactive_group_keys.keys();
+        modifier_key_codes();
+        if (init_browser_url && !init_atspi()) {
+            return throw_or_return(AutoTypeResult::OsError, "Cannot connect to AT-SPI");
+        }
+        return AutoTypeResult::Ok;
+    }
+
     [[nodiscard]] AutoTypeTextTransaction begin_batch_text_entry() {
         if (in_batch_text_entry_) {
             // for convenience, allow nested transactions, but don't do anything
             return AutoTypeTextTransaction();
         }
+        if (display()) {
+            transaction_lock_ = std::unique_lock(connection_->transaction_mutex());
+        }
+        read_keyboard_layout();
         in_batch_text_entry_ = true;
+        error_trap_.emplace();
+        reclaim_extra_key_mappings();
         return AutoTypeTextTransaction([this] {
+            restore_keyboard_state();
+            // errors are reported by flush, here we only make sure nothing is left in the queue
+            discard_pending_key_events();
+            error_trap_.reset();
             in_batch_text_entry_ = false;
-            remove_extra_key_mapping();
+            remove_scratch_keyboard_group();
+            release_extra_key_mappings();
+            if (transaction_lock_) {
+                transaction_lock_.unlock();
+            }
         });
     }
 };
 
-AutoType::AutoType() : impl_(std::make_unique<AutoType::AutoTypeImpl>()) {}
+AutoType::AutoType() : impl_(std::make_unique<AutoType::AutoTypeImpl>(stats_)) {}
 
 AutoType::~AutoType() = default;
 
@@ -369,7 +1130,61 @@ AutoTypeResult AutoType::key_move(Direction direction, char32_t character,
                    " not supported";
         return throw_or_return(AutoTypeResult::BadArg, msg);
     }
-    return impl_->key_move(direction, code.value());
+    return impl_->key_move(direction, code.value(), character);
+}
+
+uint64_t AutoType::keyboard_layout_generation() {
+    impl_->read_keyboard_layout();
+    return impl_->layout_generation();
+}
+
+uint32_t AutoType::native_key(os_key_code_t code) { return impl_->native_key(code); }
+
+std::function<bool(std::u32string_view, PackedKeyCode *)> AutoType::background_key_resolver() {
+    auto layout = impl_->background_keyboard_layout();
+    if (!layout) {
+        return nullptr;
+    }
+    return [layout = std::move(layout)](std::u32string_view text, PackedKeyCode *key_codes) {
+        std::array<uint32_t, KEY_SYMS_CHUNK_SIZE> key_syms{};
+        auto all_found = true;
+        for (size_t start = 0; start < text.length(); start += key_syms.size()) {
+            auto chunk = text.substr(start, key_syms.size());
+            chars_to_keysyms(chunk, key_syms.data());
+            for (size_t i = 0; i < chunk.length(); i++) {
+                auto found = true;
+                // NOLINTNEXTLINE(*-pointer-arithmetic)
+                key_codes[start + i] = PackedKeyCode(
+                    AutoTypeImpl::os_key_code_from_key_sym(layout.get(), key_syms.at(i), &found));
+                all_found = all_found && found;
+            }
+        }
+        return all_found;
+    };
+}
+
+AutoTypeResult AutoType::prepare_backend(const ActiveWindowArgs &args) {
+    return impl_->warm_up(args.get_browser_url);
+}
+
+void AutoType::set_key_mapping_idle_time(std::chrono::milliseconds time) {
+    impl_->set_key_mapping_idle_time(time);
+}
+
+void AutoType::set_use_scratch_keyboard_group(bool use_scratch_keyboard_group) {
+    impl_->set_use_scratch_keyboard_group(use_scratch_keyboard_group);
+}
+
+AutoTypeResult AutoType::map_missing_keys(const PackedKeyCode *keys, size_t keys_size) {
+    return impl_->add_extra_key_mappings(keys, keys_size);
+}
+
+AutoTypeResult AutoType::key_move(const TypingProgramEvent &event) {
+    if (!event.native_key) {
+        return key_move(event.direction, event.character, event.code, event.modifier);
+    }
+    return impl_->key_move(event.direction, event.code.value_or(0), event.character,
+                           event.native_key);
 }
 
 Modifier AutoType::get_pressed_modifiers() {
@@ -378,6 +1193,13 @@ Modifier AutoType::get_pressed_modifiers() {
         return Modifier::None;
     }
 
+    // base modifiers are set only while modifier keys are down,
+    // the keymap is queried only to find out which ones exactly
+    auto kbd_state = impl_->keyboard_state();
+    if (kbd_state.has_value() && !kbd_state->base_mods) {
+        return Modifier::None;
+    }
+
     static constexpr auto KEYMAP_SIZE = 32;
 
     std::array<char, KEYMAP_SIZE> keymap{};
@@ -387,8 +1209,10 @@ Modifier AutoType::get_pressed_modifiers() {
 
     auto pressed_modifiers = Modifier::None;
 
-    for (auto [key_sym, modifier] : KEY_CODES_MODIFIERS) {
-        auto key_code = XKeysymToKeycode(display, key_sym);
+    const auto &key_codes = impl_->modifier_key_codes();
+    for (size_t i = 0; i < KEY_CODES_MODIFIERS.size(); i++) {
+        auto modifier = KEY_CODES_MODIFIERS.at(i).second;
+        auto key_code = key_codes.at(i);
         if (!key_code) {
             continue;
         }
@@ -405,6 +1229,10 @@ Modifier AutoType::get_pressed_modifiers() {
     return pressed_modifiers;
 }
 
+void AutoType::wait_for_modifiers_change(std::chrono::milliseconds timeout) {
+    impl_->wait_for_modifiers_change(timeout);
+}
+
 Modifier AutoType::shortcut_modifier() { return Modifier::Ctrl; }
 
 std::optional<os_key_code_t> AutoType::os_key_code(KeyCode code) {
@@ -423,15 +1251,30 @@ std::optional<KeyCodeWithModifiers> AutoType::os_key_code_for_char(char32_t char
     return impl_->os_key_code_from_char(character);
 }
 
-std::vector<std::optional<KeyCodeWithModifiers>>
-AutoType::os_key_codes_for_chars(std::u32string_view text) {
+AutoTypeResult AutoType::os_key_codes_for_chars(std::u32string_view text,
+                                                PackedKeyCode *key_codes, size_t key_codes_size) {
+    if (key_codes_size < text.length()) {
+        return throw_or_return(AutoTypeResult::BadArg, "Key codes buffer is too small");
+    }
     impl_->read_keyboard_layout();
-    std::vector<std::optional<KeyCodeWithModifiers>> result(text.length());
-    auto length = text.length();
-    for (size_t i = 0; i < length; i++) {
-        result[i] = impl_->os_key_code_from_char(text[i]);
+    std::array<uint32_t, KEY_SYMS_CHUNK_SIZE> key_syms{};
+    auto resolve = [&] {
+        for (size_t start = 0; start < text.length(); start += key_syms.size()) {
+            auto chunk = text.substr(start, key_syms.size());
+            chars_to_keysyms(chunk, key_syms.data());
+            for (size_t i = 0; i < chunk.length(); i++) {
+                // NOLINTNEXTLINE(*-pointer-arithmetic)
+                key_codes[start + i] =
+                    PackedKeyCode(impl_->os_key_code_from_key_sym(key_syms.at(i)));
+            }
+        }
+    };
+    resolve();
+    if (!impl_->check_layout_keys(key_codes, text.length())) {
+        // the snapshot was stale, the layout has been read from the keymap
+        resolve();
     }
-    return result;
+    return AutoTypeResult::Ok;
 }
 
 pid_t AutoType::active_pid() {
@@ -440,17 +1283,14 @@ pid_t AutoType::active_pid() {
         return 0;
     }
 
-    auto prev_error_handler = XSetErrorHandler(x11_error_handler);
-
-    pid_t pid = 0;
-    Window window = x11_get_active_window(display);
-    if (window) {
-        pid = static_cast<pid_t>(x11_window_prop_ulong(display, window, "_NET_WM_PID"));
-    }
-
-    XSetErrorHandler(prev_error_handler);
-
-    return pid;
+    return impl_->ignoring_errors([&] {
+        pid_t pid = 0;
+        Window window = x11_get_active_window(display);
+        if (window) {
+            pid = static_cast<pid_t>(x11_window_prop_ulong(display, window, "_NET_WM_PID"));
+        }
+        return pid;
+    });
 }
 
 AppWindow AutoType::active_window(ActiveWindowArgs args) {
@@ -459,36 +1299,33 @@ AppWindow AutoType::active_window(ActiveWindowArgs args) {
         return {};
     }
 
-    auto prev_error_handler = XSetErrorHandler(x11_error_handler);
-
-    Window window = x11_get_active_window(display);
-    if (!window) {
-        XSetErrorHandler(prev_error_handler);
-        return {};
-    }
+    return impl_->ignoring_errors([&] {
+        Window window = x11_get_active_window(display);
+        if (!window) {
+            return AppWindow{};
+        }
 
-    AppWindow result{};
-    result.window_id = window;
-    result.pid = static_cast<pid_t>(x11_window_prop_ulong(display, window, "_NET_WM_PID"));
-    result.app_name = x11_window_prop_app_cls(display, window);
+        AppWindow result{};
+        result.window_id = window;
+        result.pid = static_cast<pid_t>(x11_window_prop_ulong(display, window, "_NET_WM_PID"));
+        result.app_name = x11_window_prop_app_cls(display, window);
 
-    if (args.get_window_title) {
-        result.title = x11_window_prop_string(display, window, "_NET_WM_NAME");
-        if (result.title.empty()) {
-            result.title = x11_window_prop_string(display, window, "WM_NAME");
+        if (args.get_window_title) {
+            result.title = x11_window_prop_string(display, window, "_NET_WM_NAME");
+            if (result.title.empty()) {
+                result.title = x11_window_prop_string(display, window, "WM_NAME");
+            }
         }
-    }
 
-    if (args.get_browser_url) {
-        if (std::find(BROWSER_APP_NAMES.begin(), BROWSER_APP_NAMES.end(), result.app_name) !=
-            BROWSER_APP_NAMES.end()) {
-            result.url = get_browser_url_using_atspi(result.pid);
+        if (args.get_browser_url) {
+            if (std::find(BROWSER_APP_NAMES.begin(), BROWSER_APP_NAMES.end(), result.app_name) !=
+                BROWSER_APP_NAMES.end()) {
+                result.url = get_browser_url_using_atspi(result.pid);
+            }
         }
-    }
-
-    XSetErrorHandler(prev_error_handler);
 
-    return result;
+        return result;
+    });
 }
 
 bool AutoType::show_window(const AppWindow &window) {
@@ -500,45 +1337,45 @@ bool AutoType::show_window(const AppWindow &window) {
         return false;
     }
 
-    auto prev_error_handler = XSetErrorHandler(x11_error_handler);
-
-    XWindowAttributes window_attr{};
-    if (!XGetWindowAttributes(display, window.window_id, &window_attr)) {
-        XSetErrorHandler(prev_error_handler);
-        return false;
-    }
-    auto root = window_attr.root;
-
-    auto window_desktop = x11_window_prop_ulong(display, window.window_id, "_NET_WM_DESKTOP");
-    auto current_desktop = x11_window_prop_ulong(display, root, "_NET_CURRENT_DESKTOP");
-    if (window_desktop != current_desktop) {
-        if (!x11_send_client_message(display, root, root, "_NET_CURRENT_DESKTOP", window_desktop)) {
-            XSetErrorHandler(prev_error_handler);
+    return impl_->ignoring_errors([&] {
+        XWindowAttributes window_attr{};
+        if (!XGetWindowAttributes(display, window.window_id, &window_attr)) {
             return false;
         }
-    }
-
-    constexpr auto WINDOW_MESSAGE_FROM_WINDOW_PAGER = 2;
-    if (!x11_send_client_message(display, window.window_id, root, "_NET_ACTIVE_WINDOW",
-                                 WINDOW_MESSAGE_FROM_WINDOW_PAGER)) {
-        XSetErrorHandler(prev_error_handler);
-        return false;
-    }
-
-    XSync(display, False);
+        auto root = window_attr.root;
+
+        auto window_desktop = x11_window_prop_ulong(display, window.window_id, "_NET_WM_DESKTOP");
+        auto current_desktop = x11_window_prop_ulong(display, root, "_NET_CURRENT_DESKTOP");
+        if (window_desktop != current_desktop) {
+            if (!x11_send_client_message(display, root, root, "_NET_CURRENT_DESKTOP",
+                                         window_desktop)) {
+                return false;
+            }
+        }
 
-    XMapRaised(display, window.window_id);
-    XSetInputFocus(display, window.window_id, RevertToParent, CurrentTime);
+        constexpr auto WINDOW_MESSAGE_FROM_WINDOW_PAGER = 2;
+        if (!x11_send_client_message(display, window.window_id, root, "_NET_ACTIVE_WINDOW",
+                                     WINDOW_MESSAGE_FROM_WINDOW_PAGER)) {
+            return false;
+        }
 
-    XSync(display, False);
+        XSync(display, False);
 
-    XSetErrorHandler(prev_error_handler);
+        XMapRaised(display, window.window_id);
+        XSetInputFocus(display, window.window_id, RevertToParent, CurrentTime);
 
-    return true;
+        return true;
+    });
 }
 
 AutoTypeTextTransaction AutoType::begin_batch_text_entry() {
     return impl_->begin_batch_text_entry();
 }
 
+AutoTypeResult AutoType::flush() { return impl_->flush(); }
+
+void AutoType::set_batch_flush_chunk_size(size_t key_events) {
+    impl_->set_batch_flush_chunk_size(key_events);
+}
+
 } // namespace keyboard_auto_type
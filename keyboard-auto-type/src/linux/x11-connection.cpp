@@ -0,0 +1,214 @@
+#include "x11-connection.h"
+
+#include <X11/XKBlib.h>
+#include <X11/extensions/XTest.h>
+
+#include <atomic>
+#include <utility>
+
+namespace keyboard_auto_type {
+
+// Xlib requires this before any other Xlib call in the process, because the display is used
+// from several threads, so it's done when the library is loaded, not when the display is opened
+// It's a no-op if the app or a newer Xlib has already done it
+[[maybe_unused]] static const auto x11_threads_initialized = XInitThreads();
+
+// open connections by display, so that the error handler knows where to record the error
+static std::mutex connections_by_display_mutex;
+static std::map<Display *, X11Connection *> connections_by_display;
+
+static std::mutex error_trap_mutex;
+static size_t error_trap_count = 0;
+// read by the handler without the lock, it's called by Xlib on any thread
+static std::atomic<XErrorHandler> prev_error_handler = nullptr;
+
+static int x11_trap_error_handler(Display *display, XErrorEvent *event) {
+    {
+        std::lock_guard lock(connections_by_display_mutex);
+        auto connection = connections_by_display.find(display);
+        if (connection != connections_by_display.end()) {
+            X11Error error{};
+            error.serial = event->serial;
+            error.error_code = event->error_code;
+            error.request_code = event->request_code;
+            connection->second->record_error(error);
+            return 0;
+        }
+    }
+    // the app's own display, its errors are handled by the app as if we weren't here
+    auto *prev_handler = prev_error_handler.load();
+    return prev_handler ? prev_handler(display, event) : 0;
+}
+
+X11ErrorTrap::X11ErrorTrap() {
+    std::lock_guard lock(error_trap_mutex);
+    if (!error_trap_count++) {
+        prev_error_handler = XSetErrorHandler(x11_trap_error_handler);
+    }
+}
+
+X11ErrorTrap::~X11ErrorTrap() {
+    std::lock_guard lock(error_trap_mutex);
+    if (!--error_trap_count) {
+        XSetErrorHandler(prev_error_handler);
+    }
+}
+
+X11Connection::X11Connection(Display *display) : display_(display) {
+    int i = 0;
+    is_supported_ = XTestQueryExtension(display_, &i, &i, &i, &i) &&
+                    XkbQueryExtension(display_, &i, &xkb_event_base_, &i, &i, &i);
+
+    std::lock_guard lock(connections_by_display_mutex);
+    connections_by_display[display_] = this;
+}
+
+X11Connection::~X11Connection() {
+    // the remaining key mappings are removed while errors are still recorded here
+    key_mapping_reaper_.stop();
+    {
+        std::lock_guard lock(connections_by_display_mutex);
+        connections_by_display.erase(display_);
+    }
+    XCloseDisplay(display_);
+}
+
+std::shared_ptr<X11Connection> X11Connection::shared(const std::string &display_name) {
+    static std::mutex connections_mutex;
+    static std::map<std::string, std::weak_ptr<X11Connection>> connections;
+
+    std::lock_guard lock(connections_mutex);
+    auto &weak_connection = connections[display_name];
+    auto connection = weak_connection.lock();
+    if (connection) {
+        return connection;
+    }
+
+    auto *display = XOpenDisplay(display_name.c_str());
+    if (!display) {
+        connections.erase(display_name);
+        return nullptr;
+    }
+    connection = std::make_shared<X11Connection>(display);
+    weak_connection = connection;
+    return connection;
+}
+
+uint64_t X11Connection::add_event_queue() {
+    std::lock_guard lock(events_mutex_);
+    auto queue_id = ++last_event_queue_id_;
+    event_queues_[queue_id];
+    return queue_id;
+}
+
+void X11Connection::remove_event_queue(uint64_t queue_id) {
+    std::lock_guard lock(events_mutex_);
+    event_queues_.erase(queue_id);
+}
+
+uint64_t X11Connection::add_event_listener(EventListener listener) {
+    std::lock_guard lock(events_mutex_);
+    auto listener_id = ++last_event_queue_id_;
+    event_listeners_.emplace(listener_id, std::move(listener));
+    return listener_id;
+}
+
+void X11Connection::remove_event_listener(uint64_t listener_id) {
+    std::lock_guard lock(events_mutex_);
+    event_listeners_.erase(listener_id);
+}
+
+void X11Connection::read_pending_events() {
+    std::lock_guard lock(events_mutex_);
+    read_events();
+}
+
+void X11Connection::EventQueue::push(const XEvent &event) {
+    if (size == MAX_QUEUED_EVENTS) {
+        // the oldest event is overwritten
+        first = (first + 1) % MAX_QUEUED_EVENTS;
+        size--;
+        lost_events = true;
+    }
+    events[(first + size) % MAX_QUEUED_EVENTS] = event;
+    size++;
+}
+
+XEvent X11Connection::EventQueue::pop() {
+    auto event = events[first];
+    first = (first + 1) % MAX_QUEUED_EVENTS;
+    size--;
+    return event;
+}
+
+void X11Connection::read_events() {
+    while (XPending(display_)) {
+        XEvent event{};
+        XNextEvent(display_, &event);
+        if (event.type == MappingNotify) {
+            // updates the key map of the display, it must be done once for all instances
+            XRefreshKeyboardMapping(&event.xmapping); // NOLINT(*-union-access)
+        }
+        for (auto &[queue_id, queue] : event_queues_) {
+            queue.push(event);
+        }
+        for (auto &[listener_id, listener] : event_listeners_) {
+            listener(event);
+        }
+    }
+}
+
+std::optional<XEvent> X11Connection::next_event(uint64_t queue_id) {
+    std::lock_guard lock(events_mutex_);
+    auto &queue = event_queues_[queue_id];
+    if (!queue.size) {
+        read_events();
+    }
+    if (!queue.size) {
+        return std::nullopt;
+    }
+    return queue.pop();
+}
+
+bool X11Connection::take_lost_events(uint64_t queue_id) {
+    std::lock_guard lock(events_mutex_);
+    auto &queue = event_queues_[queue_id];
+    auto lost_events = queue.lost_events;
+    queue.lost_events = false;
+    return lost_events;
+}
+
+void X11Connection::record_error(const X11Error &error) {
+    std::lock_guard lock(errors_mutex_);
+    auto &log = error_log_;
+    if (log.size == MAX_RECORDED_ERRORS) {
+        log.first = (log.first + 1) % MAX_RECORDED_ERRORS;
+        log.size--;
+    }
+    log.errors[(log.first + log.size) % MAX_RECORDED_ERRORS] = error;
+    log.size++;
+}
+
+std::optional<X11Error>
+X11Connection::take_error(unsigned long first_serial, // NOLINT(google-runtime-int)
+                          unsigned long last_serial) { // NOLINT(google-runtime-int)
+    std::lock_guard lock(errors_mutex_);
+    auto &log = error_log_;
+    std::optional<X11Error> taken;
+    // errors outside the range are moved to the front, keeping their order
+    size_t kept = 0;
+    for (size_t i = 0; i < log.size; i++) {
+        const auto &error = log.errors[(log.first + i) % MAX_RECORDED_ERRORS];
+        if (error.serial >= first_serial && error.serial <= last_serial) {
+            if (!taken.has_value()) {
+                taken = error;
+            }
+        } else {
+            log.errors[(log.first + kept++) % MAX_RECORDED_ERRORS] = error;
+        }
+    }
+    log.size = kept;
+    return taken;
+}
+
+} // namespace keyboard_auto_type
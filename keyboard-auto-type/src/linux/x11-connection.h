@@ -0,0 +1,131 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include "x11-helpers.h"
+#include "x11-key-mapping-reaper.h"
+#include "x11-keyboard-layout.h"
+
+namespace keyboard_auto_type {
+
+// Connection to the X server shared by all AutoType instances using the same display,
+// it's closed when the last instance has gone, so short-lived instances don't connect
+// and query extensions every time
+// Events are read by whichever instance asks first and copied to the queues of all instances,
+// each instance handles its own copies on its own thread
+class X11Connection {
+  public:
+    // Called on the thread which has read the event, with the events lock held
+    using EventListener = std::function<void(const XEvent &event)>;
+
+  private:
+    static constexpr size_t MAX_QUEUED_EVENTS = 256;
+    static constexpr size_t MAX_RECORDED_ERRORS = 16;
+
+    // Fixed ring buffer, so that reading events doesn't allocate while typing
+    struct EventQueue {
+        std::array<XEvent, MAX_QUEUED_EVENTS> events{};
+        size_t first = 0;
+        size_t size = 0;
+        // events were dropped because the instance hasn't read them for a long time
+        bool lost_events = false;
+
+        void push(const XEvent &event);
+        XEvent pop();
+    };
+
+    // errors of requests sent by all instances, until they're taken by the instance which sent them
+    struct ErrorLog {
+        std::array<X11Error, MAX_RECORDED_ERRORS> errors{};
+        size_t first = 0;
+        size_t size = 0;
+    };
+
+    Display *display_;
+    bool is_supported_ = false;
+    int xkb_event_base_ = 0;
+    std::mutex events_mutex_;
+    std::map<uint64_t, EventQueue> event_queues_;
+    std::map<uint64_t, EventListener> event_listeners_;
+    uint64_t last_event_queue_id_ = 0;
+    std::recursive_mutex transaction_mutex_;
+    std::mutex errors_mutex_;
+    ErrorLog error_log_;
+    // keys changed by all instances, so that they don't take each other's key codes
+    X11ReservedKeys reserved_keys_;
+    // stopped before the display is closed
+    X11KeyMappingReaper key_mapping_reaper_{*this};
+
+    void read_events();
+
+  public:
+    explicit X11Connection(Display *display);
+    ~X11Connection();
+    X11Connection(const X11Connection &) = delete;
+    X11Connection &operator=(const X11Connection &) = delete;
+    X11Connection(X11Connection &&) = delete;
+    X11Connection &operator=(X11Connection &&) = delete;
+
+    // Returns the open connection to the display or opens a new one, null if it can't be opened
+    static std::shared_ptr<X11Connection> shared(const std::string &display_name);
+
+    [[nodiscard]] Display *display() const { return display_; }
+    // XTest and XKB are available, checked once when the connection is opened
+    [[nodiscard]] bool is_supported() const { return is_supported_; }
+    [[nodiscard]] int xkb_event_base() const { return xkb_event_base_; }
+
+    // Held for the whole text entry, so that key events of different instances
+    // are not mixed and errors are attributed to the instance which caused them
+    std::recursive_mutex &transaction_mutex() { return transaction_mutex_; }
+
+    X11ReservedKeys &reserved_keys() { return reserved_keys_; }
+    // Idle key mappings of all instances
+    X11KeyMappingReaper &key_mapping_reaper() { return key_mapping_reaper_; }
+
+    uint64_t add_event_queue();
+    void remove_event_queue(uint64_t queue_id);
+    // Returns the next event for this queue, reading from the server without blocking
+    std::optional<XEvent> next_event(uint64_t queue_id);
+    // Returns true once if some events have been dropped from this queue
+    bool take_lost_events(uint64_t queue_id);
+    // Listeners see every event as soon as it's read by anyone, instead of waiting in a queue
+    uint64_t add_event_listener(EventListener listener);
+    // After this the listener is not called anymore
+    void remove_event_listener(uint64_t listener_id);
+    // Reads events from the server without blocking and passes them to queues and listeners
+    void read_pending_events();
+
+    // Called by the error trap, the oldest error is dropped if nobody has taken them for long
+    void record_error(const X11Error &error);
+    // Returns the first error caused by requests with serials in the range and forgets
+    // all errors in the range, errors of other requests are left for the instance which sent them
+    std::optional<X11Error> take_error(unsigned long first_serial,  // NOLINT(google-runtime-int)
+                                       unsigned long last_serial); // NOLINT(google-runtime-int)
+};
+
+// Records X11 errors on the connection of the display instead of terminating the process,
+// errors are reported asynchronously, so the trap must stay installed until the requests
+// are synced. The handler is process-wide, it's installed by the first trap and removed
+// by the last one, so that traps of several instances can overlap
+// Errors of displays not opened by us are passed to the app's handler installed before
+class X11ErrorTrap {
+  public:
+    X11ErrorTrap();
+    ~X11ErrorTrap();
+    X11ErrorTrap(const X11ErrorTrap &) = delete;
+    X11ErrorTrap &operator=(const X11ErrorTrap &) = delete;
+    X11ErrorTrap(X11ErrorTrap &&) = delete;
+    X11ErrorTrap &operator=(X11ErrorTrap &&) = delete;
+};
+
+} // namespace keyboard_auto_type
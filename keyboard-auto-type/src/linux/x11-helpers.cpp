@@ -9,10 +9,6 @@
 
 namespace keyboard_auto_type {
 
-int x11_error_handler([[maybe_unused]] Display *display, [[maybe_unused]] XErrorEvent *event) {
-    return 0;
-}
-
 struct X11WindowProp {
     void *value = nullptr;
     unsigned long nitems = 0;      // NOLINT (google-runtime-int)
@@ -132,4 +128,49 @@ bool x11_send_client_message(Display *display, Window window, Window send_to_win
     return ret != 0;
 }
 
+bool x11_window_supports_protocol(Display *display, Window window, const char *protocol) {
+    auto protocol_atom = XInternAtom(display, protocol, True);
+    if (!protocol_atom) {
+        return false;
+    }
+
+    Atom *protocols = nullptr;
+    auto count = 0;
+    if (!XGetWMProtocols(display, window, &protocols, &count)) {
+        return false;
+    }
+    auto supported = std::find(protocols, protocols + count, protocol_atom) != protocols + count;
+    XFree(protocols);
+
+    return supported;
+}
+
+bool x11_send_ping(Display *display, Window window, Time timestamp) {
+    auto protocols_atom = XInternAtom(display, "WM_PROTOCOLS", False);
+    auto ping_atom = XInternAtom(display, "_NET_WM_PING", False);
+    if (!protocols_atom || !ping_atom) {
+        return false;
+    }
+
+    XEvent event{};
+
+    constexpr auto MESSAGE_FORMAT = 32;
+
+    // the app sends the same message back to the root window
+    event.type = ClientMessage;
+    event.xclient.display = display;
+    event.xclient.window = window;
+    event.xclient.message_type = protocols_atom;
+    event.xclient.format = MESSAGE_FORMAT;
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-union-access)
+    event.xclient.data.l[0] = static_cast<long>(ping_atom); // NOLINT(google-runtime-int)
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-union-access)
+    event.xclient.data.l[1] = static_cast<long>(timestamp); // NOLINT(google-runtime-int)
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-union-access)
+    event.xclient.data.l[2] = static_cast<long>(window); // NOLINT(google-runtime-int)
+
+    auto ret = XSendEvent(display, window, False, NoEventMask, &event);
+    return ret != 0;
+}
+
 } // namespace keyboard_auto_type
@@ -3,6 +3,7 @@
 #include <X11/Xlib.h>
 
 #include <cstdint>
+#include <optional>
 #include <string>
 #include <string_view>
 
@@ -10,12 +11,19 @@
 
 namespace keyboard_auto_type {
 
-int x11_error_handler(Display *display, XErrorEvent *event);
+struct X11Error {
+    unsigned long serial = 0; // NOLINT (google-runtime-int)
+    int error_code = 0;
+    int request_code = 0;
+};
+
 std::string x11_window_prop_string(Display *display, Window window, const char *prop);
 uint64_t x11_window_prop_ulong(Display *display, Window window, const char *prop);
 std::string x11_window_prop_app_cls(Display *display, Window window);
 Window x11_get_active_window(Display *display);
 bool x11_send_client_message(Display *display, Window window, Window send_to_window,
                              const char *type, uint64_t lparam);
+bool x11_window_supports_protocol(Display *display, Window window, const char *protocol);
+bool x11_send_ping(Display *display, Window window, Time timestamp);
 
 } // namespace keyboard_auto_type
@@ -0,0 +1,112 @@
+#include "x11-key-mapping-reaper.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "x11-connection.h"
+
+namespace keyboard_auto_type {
+
+void x11_change_key_mappings(Display *display, std::vector<X11KeyMapping> mappings) {
+    std::sort(mappings.begin(), mappings.end(),
+              [](const auto &a, const auto &b) { return a.key_code < b.key_code; });
+    std::vector<KeySym> key_syms;
+    for (size_t i = 0; i < mappings.size();) {
+        auto first_key_code = mappings[i].key_code;
+        key_syms.clear();
+        while (i < mappings.size() && mappings[i].key_code == first_key_code + key_syms.size()) {
+            key_syms.push_back(mappings[i].key_sym);
+            i++;
+        }
+        XChangeKeyboardMapping(display, first_key_code, 1, key_syms.data(),
+                               static_cast<int>(key_syms.size()));
+    }
+}
+
+X11KeyMappingReaper::X11KeyMappingReaper(X11Connection &connection) : connection_(connection) {}
+
+X11KeyMappingReaper::~X11KeyMappingReaper() { stop(); }
+
+void X11KeyMappingReaper::stop() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        cv_.notify_one();
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    remove(take());
+}
+
+void X11KeyMappingReaper::put(const std::vector<X11KeyMapping> &mappings,
+                              std::chrono::milliseconds idle_time) {
+    if (mappings.empty()) {
+        return;
+    }
+    std::lock_guard lock(mutex_);
+    mappings_.insert(mappings_.end(), mappings.begin(), mappings.end());
+    deadline_ = std::chrono::steady_clock::now() + idle_time;
+    if (!thread_.joinable() && !stopping_) {
+        thread_ = std::thread([this] { run(); });
+    }
+    cv_.notify_one();
+}
+
+std::vector<X11KeyMapping> X11KeyMappingReaper::take() {
+    std::lock_guard lock(mutex_);
+    auto mappings = std::move(mappings_);
+    mappings_.clear();
+    return mappings;
+}
+
+void X11KeyMappingReaper::remove(std::vector<X11KeyMapping> mappings) {
+    if (mappings.empty()) {
+        return;
+    }
+    auto *display = connection_.display();
+    X11ErrorTrap error_trap;
+    unsigned long first_serial = 0; // NOLINT(google-runtime-int)
+    unsigned long last_serial = 0;  // NOLINT(google-runtime-int)
+    {
+        // requests are not mixed with transactions of AutoType instances,
+        // so that their errors are not attributed to them
+        std::lock_guard lock(connection_.transaction_mutex());
+        first_serial = NextRequest(display);
+        for (auto &mapping : mappings) {
+            mapping.key_sym = 0;
+        }
+        x11_change_key_mappings(display, mappings);
+        last_serial = NextRequest(display) - 1;
+    }
+    // the key codes can be reused only after the server has processed the change
+    XSync(display, False);
+    [[maybe_unused]] auto error = connection_.take_error(first_serial, last_serial);
+    for (const auto &mapping : mappings) {
+        connection_.reserved_keys().release_key_code(mapping.key_code);
+    }
+}
+
+void X11KeyMappingReaper::run() {
+    std::unique_lock lock(mutex_);
+    while (!stopping_) {
+        if (mappings_.empty()) {
+            cv_.wait(lock);
+            continue;
+        }
+        if (std::chrono::steady_clock::now() < deadline_) {
+            cv_.wait_until(lock, deadline_);
+            continue;
+        }
+
+        // the mappings have been idle long enough for all apps to process the key events,
+        // they're removed without the lock, so that take() doesn't wait for the server
+        auto mappings = std::move(mappings_);
+        mappings_.clear();
+        lock.unlock();
+        remove(std::move(mappings));
+        lock.lock();
+    }
+}
+
+} // namespace keyboard_auto_type
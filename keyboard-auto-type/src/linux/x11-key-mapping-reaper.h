@@ -0,0 +1,57 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace keyboard_auto_type {
+
+class X11Connection;
+
+struct X11KeyMapping {
+    uint8_t key_code = 0;
+    KeySym key_sym = 0;
+};
+
+// Sends key mappings without waiting, consecutive key codes are changed in one request
+void x11_change_key_mappings(Display *display, std::vector<X11KeyMapping> mappings);
+
+// Keeps temporary key mappings installed between text entries and removes them
+// on a background thread after they have been idle for a while
+// There's one reaper per shared connection, idle mappings of all instances are kept together,
+// so that any instance can take them back
+class X11KeyMappingReaper {
+  private:
+    X11Connection &connection_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<X11KeyMapping> mappings_;
+    std::chrono::steady_clock::time_point deadline_;
+    bool stopping_ = false;
+    std::thread thread_;
+
+    void run();
+    void remove(std::vector<X11KeyMapping> mappings);
+
+  public:
+    explicit X11KeyMappingReaper(X11Connection &connection);
+    ~X11KeyMappingReaper();
+    X11KeyMappingReaper(const X11KeyMappingReaper &) = delete;
+    X11KeyMappingReaper &operator=(const X11KeyMappingReaper &) = delete;
+    X11KeyMappingReaper(X11KeyMappingReaper &&) = delete;
+    X11KeyMappingReaper &operator=(X11KeyMappingReaper &&) = delete;
+
+    // Hands over idle mappings, they are removed if not taken back within idle_time
+    void put(const std::vector<X11KeyMapping> &mappings, std::chrono::milliseconds idle_time);
+    // Takes back the mappings which are still installed, doesn't wait for the server
+    std::vector<X11KeyMapping> take();
+    // Stops the thread and removes the remaining mappings, called before the display is closed
+    void stop();
+};
+
+} // namespace keyboard_auto_type
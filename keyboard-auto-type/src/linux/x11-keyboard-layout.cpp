@@ -0,0 +1,467 @@
+#include "x11-keyboard-layout.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <map>
+#include <utility>
+
+#include "x11-connection.h"
+#include "x11-layout-snapshot.h"
+
+namespace keyboard_auto_type {
+
+// events can be read from the socket to the Xlib queue by a round trip on another thread,
+// then the socket is not readable, such events are picked up at least this often
+static constexpr auto WATCHER_EVENTS_POLL_INTERVAL = std::chrono::milliseconds(1000);
+
+bool X11ReservedKeys::try_reserve_key_code(uint8_t key_code) {
+    auto bit = uint64_t{1} << (key_code % KEY_CODES_PER_WORD);
+    return !(key_codes_.at(key_code / KEY_CODES_PER_WORD).fetch_or(bit) & bit);
+}
+
+void X11ReservedKeys::release_key_code(uint8_t key_code) {
+    key_codes_.at(key_code / KEY_CODES_PER_WORD) &=
+        ~(uint64_t{1} << (key_code % KEY_CODES_PER_WORD));
+}
+
+bool X11ReservedKeys::is_reserved_key_code(uint8_t key_code) const {
+    return key_codes_.at(key_code / KEY_CODES_PER_WORD) &
+           (uint64_t{1} << (key_code % KEY_CODES_PER_WORD));
+}
+
+void X11ReservedKeys::reserve_group(int group) { group_ = group; }
+
+void X11ReservedKeys::release_group() { group_ = -1; }
+
+bool X11ReservedKeys::is_reserved_group(int group) const { return group_ == group; }
+
+int X11ReservedKeys::reserved_group() const { return group_; }
+
+bool X11ReservedKeys::empty() const {
+    return group_ < 0 && std::all_of(key_codes_.begin(), key_codes_.end(),
+                                     [](const auto &key_codes) { return !key_codes; });
+}
+
+int x11_key_shift_levels(XkbDescPtr kbd, uint16_t key_code, int group) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-constant-array-index)
+    auto shift_levels_count = XkbKeyGroupWidth(kbd, key_code, group);
+    if (shift_levels_count > 1) {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-constant-array-index)
+        auto *key_type = XkbKeyKeyType(kbd, key_code, group);
+        if (key_type->map_count > 0 && key_type->map[0].mods.mask == ShiftMask) {
+            // for most of keys we consider two states
+            shift_levels_count = 2;
+        } else {
+            // all other modifiers are ignored for now
+            shift_levels_count = 1;
+        }
+    }
+    return shift_levels_count;
+}
+
+XkbDescHandle x11_get_key_sym_map(Display *display) {
+    // compatibility map and geometry are many times bigger and not needed to find keys
+    return XkbDescHandle(XkbGetMap(display, XkbKeyTypesMask | XkbKeySymsMask, XkbUseCoreKbd));
+}
+
+void X11InactiveGroupKeys::defer(XkbDescHandle kbd, uint8_t active_group, int reserved_group,
+                                 std::vector<uint8_t> skipped_key_codes) {
+    kbd_ = std::move(kbd);
+    active_group_ = active_group;
+    reserved_group_ = reserved_group;
+    skipped_key_codes_ = std::move(skipped_key_codes);
+}
+
+void X11InactiveGroupKeys::assign(X11KeySymTable keys) {
+    std::call_once(built_, [&] { keys_ = std::move(keys); });
+}
+
+const X11KeySymTable &X11InactiveGroupKeys::keys() const {
+    std::call_once(built_, [this] { build(); });
+    return keys_;
+}
+
+void X11InactiveGroupKeys::build() const {
+    if (!kbd_) {
+        return;
+    }
+    auto *kbd = kbd_.get();
+    for (uint16_t key_code = kbd->min_key_code; key_code <= kbd->max_key_code; key_code++) {
+        if (std::binary_search(skipped_key_codes_.begin(), skipped_key_codes_.end(), key_code)) {
+            continue;
+        }
+        auto key_groups_num = XkbKeyNumGroups(kbd, key_code);
+        for (auto group = 0; group < key_groups_num; group++) {
+            if (group == active_group_ || group == reserved_group_) {
+                continue;
+            }
+            auto shift_levels_count = x11_key_shift_levels(kbd, key_code, group);
+            for (auto shift_level = 0; shift_level < shift_levels_count; shift_level++) {
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                auto sym = XkbKeySymEntry(kbd, key_code, shift_level, group);
+                if (!sym || keys_.contains(sym)) {
+                    continue;
+                }
+                KeyCodeWithMask kc{};
+                kc.key_code = key_code;
+                kc.group = group;
+                if (shift_level > 0) {
+                    kc.mod_mask = ShiftMask;
+                }
+                keys_.insert_or_assign(sym, kc);
+            }
+        }
+    }
+    kbd_.reset();
+}
+
+std::shared_ptr<X11KeyboardLayout> x11_build_keyboard_layout(XkbDescHandle kbd_handle,
+                                                             uint8_t active_group,
+                                                             const X11ReservedKeys &reserved_keys) {
+    auto *kbd = kbd_handle.get();
+    auto layout = std::make_shared<X11KeyboardLayout>();
+    layout->group = active_group;
+    layout->key_hashes.resize(XkbMaxLegalKeyCode + 1);
+    auto &keys = layout->keys;
+    // most of key syms are Latin-1 and don't take space in the table, this is usually enough
+    keys.reserve(kbd->max_key_code - kbd->min_key_code + 1);
+
+    auto has_inactive_groups = false;
+    for (uint16_t key_code = kbd->min_key_code; key_code <= kbd->max_key_code; key_code++) {
+        if (reserved_keys.is_reserved_key_code(key_code)) {
+            // mapped by us, it's still available for other characters
+            layout->empty_key_codes.push_back(key_code);
+            continue;
+        }
+        layout->key_hashes[key_code] = x11_key_hash(kbd, key_code, reserved_keys);
+        auto key_groups_num = XkbKeyNumGroups(kbd, key_code);
+        auto is_empty = true;
+        for (auto group = 0; group < key_groups_num; group++) {
+            if (reserved_keys.is_reserved_group(group)) {
+                continue;
+            }
+            auto shift_levels_count = x11_key_shift_levels(kbd, key_code, group);
+            for (auto shift_level = 0; shift_level < shift_levels_count; shift_level++) {
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                auto sym = XkbKeySymEntry(kbd, key_code, shift_level, group);
+                if (!sym) {
+                    continue;
+                }
+                is_empty = false;
+                if (group != active_group) {
+                    has_inactive_groups = true;
+                    continue;
+                }
+                // inside the active group, the first key has priority
+                if (keys.contains(sym)) {
+                    continue;
+                }
+                KeyCodeWithMask kc{};
+                kc.key_code = key_code;
+                kc.group = group;
+                if (shift_level > 0) {
+                    kc.mod_mask = ShiftMask;
+                }
+                keys.insert_or_assign(sym, kc);
+            }
+        }
+        if (is_empty) {
+            layout->empty_key_codes.push_back(key_code);
+        }
+    }
+
+    layout->keymap_hash = x11_keymap_hash(layout->key_hashes);
+
+    if (has_inactive_groups) {
+        layout->inactive_group_keys.defer(std::move(kbd_handle), active_group,
+                                          reserved_keys.reserved_group(), layout->empty_key_codes);
+    }
+
+    return layout;
+}
+
+std::shared_ptr<X11KeyboardLayout> x11_read_keyboard_layout(Display *display, uint8_t active_group,
+                                                            const X11ReservedKeys &reserved_keys,
+                                                            bool load_snapshot) {
+    // snapshots don't know about keys changed by us
+    auto keymap_id = reserved_keys.empty() ? x11_keymap_id(display) : 0;
+    if (keymap_id && load_snapshot) {
+        // the key sym map is not fetched at all, keys are checked when they're used
+        auto layout = x11_load_layout_snapshot(keymap_id, active_group);
+        if (layout) {
+            return layout;
+        }
+    }
+
+    auto kbd = x11_get_key_sym_map(display);
+    if (!kbd) {
+        return nullptr;
+    }
+    auto layout = x11_build_keyboard_layout(std::move(kbd), active_group, reserved_keys);
+    layout->keymap_id = keymap_id;
+    layout->needs_snapshot = keymap_id != 0;
+    return layout;
+}
+
+static bool layout_keys_equal(const X11KeyboardLayout &a, const X11KeyboardLayout &b) {
+    // inactive groups are built from the same key sym map, so the hash covers them
+    return a.group == b.group && a.keymap_hash == b.keymap_hash &&
+           a.empty_key_codes == b.empty_key_codes && a.keys == b.keys;
+}
+
+X11KeyboardLayoutWatcher::X11KeyboardLayoutWatcher(std::string display_name)
+    : display_name_(std::move(display_name)) {}
+
+std::shared_ptr<X11KeyboardLayoutWatcher>
+X11KeyboardLayoutWatcher::shared(const std::string &display_name) {
+    static std::mutex watchers_mutex;
+    static std::map<std::string, std::weak_ptr<X11KeyboardLayoutWatcher>> watchers;
+
+    std::lock_guard lock(watchers_mutex);
+    auto &weak_watcher = watchers[display_name];
+    auto watcher = weak_watcher.lock();
+    if (!watcher) {
+        watcher = std::make_shared<X11KeyboardLayoutWatcher>(display_name);
+        weak_watcher = watcher;
+    }
+    return watcher;
+}
+
+X11KeyboardLayoutWatcher::~X11KeyboardLayoutWatcher() {
+    stopping_ = true;
+    if (thread_.joinable()) {
+        wake();
+        thread_.join();
+    }
+    for (auto fd : wake_pipe_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+std::shared_ptr<const X11KeyboardLayout> X11KeyboardLayoutWatcher::layout() {
+    std::lock_guard lock(mutex_);
+    if (!thread_.joinable() && wake_pipe_[0] < 0) {
+        auto connection = X11Connection::shared(display_name_);
+        if (connection && connection->is_supported() && pipe(wake_pipe_.data()) == 0) {
+            fcntl(wake_pipe_[0], F_SETFL, O_NONBLOCK);
+            connection_ = std::move(connection);
+            thread_ = std::thread([this] { run(); });
+        }
+    }
+    return layout_;
+}
+
+std::shared_ptr<const X11KeyboardLayout> X11KeyboardLayoutWatcher::switch_group(uint8_t group) {
+    std::lock_guard lock(mutex_);
+    auto layout = find_cached_layout(group);
+    if (layout) {
+        layout_ = layout;
+    }
+    return layout;
+}
+
+uint64_t X11KeyboardLayoutWatcher::keymap_serial() {
+    std::lock_guard lock(mutex_);
+    return keymap_serial_;
+}
+
+std::shared_ptr<const X11KeyboardLayout>
+X11KeyboardLayoutWatcher::publish(std::shared_ptr<X11KeyboardLayout> layout,
+                                  uint64_t keymap_serial) {
+    std::lock_guard lock(mutex_);
+    if (keymap_serial != keymap_serial_) {
+        return nullptr;
+    }
+    if (layout_ && layout_keys_equal(*layout, *layout_)) {
+        layout->generation = layout_->generation;
+    } else {
+        layout->generation = ++last_generation_;
+    }
+    layout->keymap_serial = keymap_serial_;
+    layout_ = std::move(layout);
+
+    // replace the previous layout of the same group, if any
+    auto same_group =
+        std::find_if(layout_cache_.begin(), layout_cache_.end(),
+                     [&](const auto &cached) { return cached->group == layout_->group; });
+    if (same_group != layout_cache_.end()) {
+        layout_cache_.erase(same_group);
+    } else if (layout_cache_.size() >= LAYOUT_CACHE_SIZE) {
+        layout_cache_.pop_back();
+    }
+    layout_cache_.insert(layout_cache_.begin(), layout_);
+
+    if (layout_->needs_snapshot && thread_.joinable()) {
+        unsaved_layout_ = layout_;
+        wake();
+    }
+
+    return layout_;
+}
+
+void X11KeyboardLayoutWatcher::wake() {
+    char wake = 0;
+    [[maybe_unused]] auto written = write(wake_pipe_[1], &wake, 1);
+}
+
+void X11KeyboardLayoutWatcher::save_snapshot() {
+    std::shared_ptr<const X11KeyboardLayout> layout;
+    {
+        std::lock_guard lock(mutex_);
+        layout = std::move(unsaved_layout_);
+    }
+    if (layout) {
+        x11_save_layout_snapshot(*layout);
+    }
+}
+
+std::shared_ptr<const X11KeyboardLayout>
+X11KeyboardLayoutWatcher::find_cached_layout(uint8_t group) {
+    auto found = std::find_if(layout_cache_.begin(), layout_cache_.end(), [&](const auto &cached) {
+        return cached->group == group && cached->keymap_serial == keymap_serial_;
+    });
+    if (found == layout_cache_.end()) {
+        return nullptr;
+    }
+    // move to the front, it's the most recently used now
+    std::rotate(layout_cache_.begin(), found, found + 1);
+    return layout_cache_.front();
+}
+
+void X11KeyboardLayoutWatcher::invalidate() {
+    std::lock_guard lock(mutex_);
+    keymap_serial_++;
+    // until the new keymap is read, instances read it themselves instead of typing old key codes
+    layout_.reset();
+    layout_cache_.clear();
+}
+
+bool X11KeyboardLayoutWatcher::is_layout_changed(const XkbEvent &event) {
+    // NOLINTBEGIN(cppcoreguidelines-pro-type-union-access)
+    if (event.any.xkb_type != XkbMapNotify) {
+        return event.any.xkb_type == XkbNewKeyboardNotify;
+    }
+    const auto &map_event = event.map;
+    if (map_event.changed & XkbKeyTypesMask) {
+        return true;
+    }
+    if (!(map_event.changed & XkbKeySymsMask)) {
+        return false;
+    }
+    // changes of empty key codes come from us remapping them, the layout is the same
+    std::lock_guard lock(mutex_);
+    if (!layout_) {
+        return true;
+    }
+    const auto &empty_key_codes = layout_->empty_key_codes;
+    for (auto i = 0; i < map_event.num_key_syms; i++) {
+        auto key_code = static_cast<uint8_t>(map_event.first_key_sym + i);
+        if (std::find(empty_key_codes.begin(), empty_key_codes.end(), key_code) ==
+            empty_key_codes.end()) {
+            return true;
+        }
+    }
+    return false;
+    // NOLINTEND(cppcoreguidelines-pro-type-union-access)
+}
+
+void X11KeyboardLayoutWatcher::handle_event(const XEvent &event) {
+    if (event.type != connection_->xkb_event_base()) {
+        return;
+    }
+    const auto &xkb_event = *reinterpret_cast<const XkbEvent *>(&event);
+    // NOLINTBEGIN(cppcoreguidelines-pro-type-union-access)
+    if (xkb_event.any.xkb_type == XkbStateNotify) {
+        // modifier changes selected by AutoType instances come here as well
+        if (!(xkb_event.state.changed & XkbGroupStateMask)) {
+            return;
+        }
+    } else if (is_layout_changed(xkb_event)) {
+        invalidate();
+    }
+    // NOLINTEND(cppcoreguidelines-pro-type-union-access)
+    layout_events_ = true;
+    wake();
+}
+
+void X11KeyboardLayoutWatcher::read_layout() {
+    auto *display = connection_->display();
+    // requests are not mixed with the transactions of AutoType instances,
+    // so that their errors are not attributed to them
+    std::lock_guard lock(connection_->transaction_mutex());
+    X11ErrorTrap error_trap;
+    auto first_serial = NextRequest(display);
+
+    XkbStateRec kbd_state{};
+    if (!XkbGetState(display, XkbUseCoreKbd, &kbd_state) && !switch_group(kbd_state.group)) {
+        auto serial = keymap_serial();
+        auto layout = x11_read_keyboard_layout(display, kbd_state.group,
+                                               connection_->reserved_keys());
+        if (layout) {
+            // if the keymap has changed meanwhile, it's read again after the event
+            publish(std::move(layout), serial);
+        }
+    }
+
+    // the last request had a reply, all errors have been received before it
+    [[maybe_unused]] auto error = connection_->take_error(first_serial, NextRequest(display) - 1);
+}
+
+void X11KeyboardLayoutWatcher::run() {
+    auto *display = connection_->display();
+    auto listener_id =
+        connection_->add_event_listener([this](const XEvent &event) { handle_event(event); });
+
+    {
+        std::lock_guard lock(connection_->transaction_mutex());
+        X11ErrorTrap error_trap;
+        auto first_serial = NextRequest(display);
+        // only the bits of these events are changed, the selection of AutoType instances stays
+        auto map_events = XkbNewKeyboardNotifyMask | XkbMapNotifyMask;
+        XkbSelectEvents(display, XkbUseCoreKbd, map_events, map_events);
+        XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify, XkbGroupStateMask,
+                              XkbGroupStateMask);
+        XSync(display, False);
+        [[maybe_unused]] auto error =
+            connection_->take_error(first_serial, NextRequest(display) - 1);
+    }
+    read_layout();
+
+    while (!stopping_) {
+        connection_->read_pending_events();
+        if (layout_events_.exchange(false)) {
+            // several events usually come together, they are all handled by one read
+            read_layout();
+            continue;
+        }
+
+        // only when there's nothing else to do, the layout is usable before it's saved
+        save_snapshot();
+
+        std::array<pollfd, 2> fds{};
+        fds[0].fd = ConnectionNumber(display);
+        fds[0].events = POLLIN;
+        fds[1].fd = wake_pipe_[0];
+        fds[1].events = POLLIN;
+        auto timeout = static_cast<int>(WATCHER_EVENTS_POLL_INTERVAL.count());
+        if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            std::array<char, 16> wake_bytes{};
+            while (read(wake_pipe_[0], wake_bytes.data(), wake_bytes.size()) > 0) {
+            }
+        }
+    }
+
+    connection_->remove_event_listener(listener_id);
+}
+
+} // namespace keyboard_auto_type
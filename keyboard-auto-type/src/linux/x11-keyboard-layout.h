@@ -0,0 +1,186 @@
+#pragma once
+
+#include <X11/XKBlib.h>
+#include <X11/Xlib.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "x11-keysym-table.h"
+
+namespace keyboard_auto_type {
+
+class X11Connection;
+class X11LayoutSnapshot;
+
+// Key codes and the keyboard group temporarily changed by us,
+// the layout treats them as empty, so that it's not affected by our changes
+class X11ReservedKeys {
+  private:
+    static constexpr size_t KEY_CODES_PER_WORD = 64;
+    std::array<std::atomic<uint64_t>, 256 / KEY_CODES_PER_WORD> key_codes_{};
+    std::atomic<int> group_ = -1;
+
+  public:
+    // Returns false if the key code has already been reserved, by this or another instance
+    [[nodiscard]] bool try_reserve_key_code(uint8_t key_code);
+    void release_key_code(uint8_t key_code);
+    [[nodiscard]] bool is_reserved_key_code(uint8_t key_code) const;
+    void reserve_group(int group);
+    void release_group();
+    [[nodiscard]] bool is_reserved_group(int group) const;
+    // -1 if no group is reserved
+    [[nodiscard]] int reserved_group() const;
+    // true if nothing is reserved
+    [[nodiscard]] bool empty() const;
+};
+
+struct XkbDescDeleter {
+    void operator()(XkbDescPtr kbd) const { XkbFreeKeyboard(kbd, XkbAllComponentsMask, True); }
+};
+using XkbDescHandle = std::unique_ptr<XkbDescRec, XkbDescDeleter>;
+
+// Keys of groups other than the active one, they're needed only for characters missing
+// in the active group, so the table is built from the key sym map on first use
+class X11InactiveGroupKeys {
+  private:
+    mutable std::once_flag built_;
+    mutable X11KeySymTable keys_;
+    mutable XkbDescHandle kbd_;
+    uint8_t active_group_ = 0;
+    int reserved_group_ = -1;
+    // key codes reserved by us or without any key syms
+    std::vector<uint8_t> skipped_key_codes_;
+
+    void build() const;
+
+  public:
+    // Keeps the key sym map until the keys are needed
+    void defer(XkbDescHandle kbd, uint8_t active_group, int reserved_group,
+               std::vector<uint8_t> skipped_key_codes);
+    // Takes the keys built before, for example, read from a snapshot
+    void assign(X11KeySymTable keys);
+    [[nodiscard]] const X11KeySymTable &keys() const;
+};
+
+// Snapshot of the keyboard layout, it's never changed after it has been read
+struct X11KeyboardLayout {
+    uint8_t group = 0; // aka "layout" or "input language"
+    // changes only if the keys are different from the previous layout
+    uint64_t generation = 0;
+    // incremented by the watcher every time the keymap is changed
+    uint64_t keymap_serial = 0;
+    // hash of the key sym map the layout has been built from
+    uint64_t keymap_hash = 0;
+    // the keymap names the snapshot is saved by, see x11_keymap_id, 0 if it must not be saved
+    uint64_t keymap_id = 0;
+    // hashes of the keys the layout has been built from, indexed by key code, empty if it's
+    // taken from a snapshot
+    std::vector<uint64_t> key_hashes;
+    // the file the tables of the layout are mapped from, null if the layout is built from
+    // the keymap, its keys must be checked before they're used, see x11_check_snapshot_keys
+    std::shared_ptr<X11LayoutSnapshot> snapshot;
+    // keys of the active group, in case of duplicates, the first key has priority
+    X11KeySymTable keys;
+    X11InactiveGroupKeys inactive_group_keys;
+    // key codes without key syms, used to type characters missing in the layout
+    std::vector<uint8_t> empty_key_codes;
+    // built from the keymap without a snapshot, the watcher saves it after it's published
+    bool needs_snapshot = false;
+
+    // Active group always has priority, so that we press "heZ" in German layout to get "heY"
+    [[nodiscard]] const KeyCodeWithMask *find(KeySym key_sym) const {
+        const auto *key = keys.find(key_sym);
+        return key ? key : inactive_group_keys.keys().find(key_sym);
+    }
+    [[nodiscard]] bool contains(KeySym key_sym) const { return find(key_sym) != nullptr; }
+};
+
+// Number of shift levels of the key in the group taken into account in the layout
+int x11_key_shift_levels(XkbDescPtr kbd, uint16_t key_code, int group);
+
+// Fetches only the parts of the keymap the layout is built from: key types and key syms
+XkbDescHandle x11_get_key_sym_map(Display *display);
+
+// Builds the active group, other groups are built from kbd later, if they're ever used
+std::shared_ptr<X11KeyboardLayout> x11_build_keyboard_layout(XkbDescHandle kbd,
+                                                             uint8_t active_group,
+                                                             const X11ReservedKeys &reserved_keys);
+
+// Takes the layout from a snapshot on disk if there's one for the keymap, otherwise reads it
+// from the keymap, load_snapshot is false if the snapshot has turned out to be stale
+// Nothing is saved here, because saving builds all groups, this is done by the watcher
+std::shared_ptr<X11KeyboardLayout> x11_read_keyboard_layout(Display *display, uint8_t active_group,
+                                                            const X11ReservedKeys &reserved_keys,
+                                                            bool load_snapshot = true);
+
+// Reads the layout again on a background thread using the shared connection, when the keymap
+// or the active group changes, the typing thread takes the latest snapshot without waiting
+// The layout is invalidated by whichever thread reads the keymap event from the connection,
+// so that the typing thread never takes a layout of the previous keymap
+// New layouts are saved to snapshots on the same thread, also the ones read by the typing thread
+// Layouts of recently used groups are cached, so switching back to a group doesn't read anything
+// There's one watcher per display in the process, shared by all living AutoType instances
+class X11KeyboardLayoutWatcher {
+  private:
+    static constexpr size_t LAYOUT_CACHE_SIZE = 4;
+
+    std::string display_name_;
+    // set when the thread is started
+    std::shared_ptr<X11Connection> connection_;
+    std::mutex mutex_;
+    std::shared_ptr<const X11KeyboardLayout> layout_;
+    // the most recently used first
+    std::vector<std::shared_ptr<const X11KeyboardLayout>> layout_cache_;
+    // published, but not saved to a snapshot yet
+    std::shared_ptr<const X11KeyboardLayout> unsaved_layout_;
+    uint64_t keymap_serial_ = 0;
+    uint64_t last_generation_ = 0;
+    std::atomic<bool> stopping_ = false;
+    // the keymap or the group has changed, the layout must be read
+    std::atomic<bool> layout_events_ = false;
+    std::array<int, 2> wake_pipe_{-1, -1};
+    std::thread thread_;
+
+    void run();
+    void wake();
+    void handle_event(const XEvent &event);
+    void read_layout();
+    void save_snapshot();
+    bool is_layout_changed(const XkbEvent &event);
+    void invalidate();
+    std::shared_ptr<const X11KeyboardLayout> find_cached_layout(uint8_t group);
+
+  public:
+    explicit X11KeyboardLayoutWatcher(std::string display_name);
+    ~X11KeyboardLayoutWatcher();
+    X11KeyboardLayoutWatcher(const X11KeyboardLayoutWatcher &) = delete;
+    X11KeyboardLayoutWatcher &operator=(const X11KeyboardLayoutWatcher &) = delete;
+    X11KeyboardLayoutWatcher(X11KeyboardLayoutWatcher &&) = delete;
+    X11KeyboardLayoutWatcher &operator=(X11KeyboardLayoutWatcher &&) = delete;
+
+    // Returns the watcher of the display, it's shared by all instances and stopped when the last
+    // one has gone, so that the thread and the connection don't outlive them
+    static std::shared_ptr<X11KeyboardLayoutWatcher> shared(const std::string &display_name);
+
+    // Returns the latest layout, starts watching on the first call, can be null,
+    // it's null after the keymap has changed, until the new one is read
+    std::shared_ptr<const X11KeyboardLayout> layout();
+    // Makes the cached layout of the group current, returns null if it's not cached
+    std::shared_ptr<const X11KeyboardLayout> switch_group(uint8_t group);
+    // Incremented when the keymap changes, taken before reading a layout to publish
+    uint64_t keymap_serial();
+    // Replaces the layout with a newer one, assigns its generation
+    // Returns null if the keymap has changed since keymap_serial was taken,
+    // the layout may be built from the old keymap then, so it's dropped
+    std::shared_ptr<const X11KeyboardLayout> publish(std::shared_ptr<X11KeyboardLayout> layout,
+                                                     uint64_t keymap_serial);
+};
+
+} // namespace keyboard_auto_type
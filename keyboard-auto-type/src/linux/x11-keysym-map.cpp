@@ -6,6 +6,10 @@
 #include <array>
 #include <limits>
 
+#if KEYBOARD_AUTO_TYPE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace keyboard_auto_type {
 
 // This mapping is generated by x11-keysyms.js
@@ -184,40 +188,219 @@ constexpr std::array CHAR_MAP_LOW{
 };
 
 constexpr auto MIN_CHAR_IN_CHAR_MAP_16 = CHAR_MAP_16.front() >> 16;
-constexpr auto MAX_CHAR_IN_CHAR_MAP_16 = CHAR_MAP_16.back() >> 16;
-constexpr auto MIN_CHAR_IN_CHAR_MAP_32 = CHAR_MAP_32.front() >> 32;
-constexpr auto MAX_CHAR_IN_CHAR_MAP_32 = CHAR_MAP_32.back() >> 32;
 constexpr auto ADD_CODEPOINT = 0x1'000'000;
 constexpr auto SHIFT_WORD = 16;
 constexpr auto SHIFT_DWORD = 32;
 
-uint32_t char_to_keysym(char32_t ch) {
-    if (ch >= MIN_CHAR_IN_CHAR_MAP_32 && ch <= MAX_CHAR_IN_CHAR_MAP_32) {
-        const auto *found_in_32 = std::find_if(CHAR_MAP_32.begin(), CHAR_MAP_32.end(),
-                                               [ch](auto val) { return val >> SHIFT_DWORD == ch; });
-        if (found_in_32 != CHAR_MAP_32.end() && *found_in_32 >> SHIFT_DWORD == ch) {
-            return *found_in_32 & std::numeric_limits<uint32_t>::max();
+// The maps above are expanded at compile time to a two-level table:
+// the high byte of a code point selects a page, the low byte selects a key sym in it.
+// Pages without any mapped characters point to the empty page 0.
+constexpr auto PAGE_SHIFT = 8;
+constexpr auto PAGE_SIZE = 1U << PAGE_SHIFT;
+constexpr auto PAGE_MASK = PAGE_SIZE - 1;
+constexpr auto PAGED_CHARS = 0x10000U;
+constexpr auto PAGE_INDEX_SIZE = PAGED_CHARS / PAGE_SIZE;
+// a key sym that doesn't fit in 16 bits, it's looked up in CHAR_MAP_32
+constexpr uint16_t KEY_SYM_IN_CHAR_MAP_32 = 1;
+
+using KeySymPage = std::array<uint16_t, PAGE_SIZE>;
+
+template <typename Fn> constexpr void for_each_paged_char(Fn fn) {
+    for (auto [char_code, key_sym] : CHAR_MAP_LOW) {
+        fn(static_cast<uint32_t>(char_code), static_cast<uint16_t>(key_sym));
+    }
+    for (auto val : CHAR_MAP_16) {
+        fn(val >> SHIFT_WORD, static_cast<uint16_t>(val));
+    }
+    for (auto val : CHAR_MAP_32) {
+        fn(static_cast<uint32_t>(val >> SHIFT_DWORD), KEY_SYM_IN_CHAR_MAP_32);
+    }
+}
+
+constexpr std::array<uint8_t, PAGE_INDEX_SIZE> build_page_index() {
+    std::array<uint8_t, PAGE_INDEX_SIZE> page_index{};
+    uint8_t pages_count = 1;
+    for_each_paged_char([&](uint32_t char_code, uint16_t) {
+        auto &page = page_index[char_code >> PAGE_SHIFT];
+        if (!page) {
+            page = pages_count++;
         }
+    });
+    return page_index;
+}
+
+constexpr auto PAGE_INDEX = build_page_index();
+
+constexpr size_t count_pages() {
+    size_t max_page = 0;
+    for (auto page : PAGE_INDEX) {
+        max_page = std::max<size_t>(max_page, page);
     }
+    return max_page + 1;
+}
+
+constexpr auto PAGES_COUNT = count_pages();
 
-    if (ch >= MIN_CHAR_IN_CHAR_MAP_16 && ch <= MAX_CHAR_IN_CHAR_MAP_16) {
-        auto search_val = ch << SHIFT_WORD;
-        const auto *found = std::upper_bound(CHAR_MAP_16.begin(), CHAR_MAP_16.end(), search_val);
-        if (found != CHAR_MAP_16.end() && *found >> SHIFT_WORD == ch) {
-            return *found & std::numeric_limits<uint16_t>::max();
+constexpr std::array<KeySymPage, PAGES_COUNT> build_pages() {
+    std::array<KeySymPage, PAGES_COUNT> pages{};
+    for_each_paged_char([&](uint32_t char_code, uint16_t key_sym) {
+        pages[PAGE_INDEX[char_code >> PAGE_SHIFT]][char_code & PAGE_MASK] = key_sym;
+    });
+    return pages;
+}
+
+constexpr auto KEY_SYM_PAGES = build_pages();
+
+static uint32_t special_char_to_keysym(char32_t ch) {
+    for (auto val : CHAR_MAP_32) {
+        if (val >> SHIFT_DWORD == ch) {
+            return val & std::numeric_limits<uint32_t>::max();
+        }
+    }
+    return 0;
+}
+
+uint32_t char_to_keysym(char32_t ch) {
+    if (ch < PAGED_CHARS) {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-constant-array-index)
+        auto key_sym = KEY_SYM_PAGES[PAGE_INDEX[ch >> PAGE_SHIFT]][ch & PAGE_MASK];
+        if (key_sym > KEY_SYM_IN_CHAR_MAP_32) {
+            return key_sym;
+        }
+        if (key_sym == KEY_SYM_IN_CHAR_MAP_32) {
+            return special_char_to_keysym(ch);
+        }
+        if (ch < MIN_CHAR_IN_CHAR_MAP_16) {
+            // control characters without key syms
+            return 0;
         }
     }
+    return ADD_CODEPOINT + ch;
+}
 
-    if (ch < MIN_CHAR_IN_CHAR_MAP_16) {
-        for (auto [char_code, key_sym] : CHAR_MAP_LOW) {
-            if (ch == char_code) {
-                return key_sym;
+// Printable ASCII and Latin-1 characters have key syms equal to their code points,
+// SIMD versions copy blocks of them as is and convert other blocks one by one
+constexpr std::array<std::pair<char32_t, char32_t>, 2> IDENTITY_RANGES{
+    std::make_pair(U'\x20', U'\x7e'),
+    std::make_pair(U'\xa0', U'\xff'),
+};
+
+constexpr bool is_identity_range_mapped() {
+    for (auto [first, last] : IDENTITY_RANGES) {
+        for (auto ch = first; ch <= last; ch++) {
+            if (KEY_SYM_PAGES[PAGE_INDEX[ch >> PAGE_SHIFT]][ch & PAGE_MASK] != ch) {
+                return false;
             }
         }
-        return 0;
     }
+    return true;
+}
+
+static_assert(is_identity_range_mapped(), "Latin-1 key syms must be equal to code points");
+
+void chars_to_keysyms_scalar(std::u32string_view chars, uint32_t *key_syms) {
+    for (auto ch : chars) {
+        *key_syms++ = char_to_keysym(ch); // NOLINT(*-pointer-arithmetic)
+    }
+}
+
+#if KEYBOARD_AUTO_TYPE_X86_SIMD
+
+// NOLINTBEGIN(*-reinterpret-cast,*-pointer-arithmetic)
+
+constexpr auto SIGN_BIT = std::numeric_limits<int32_t>::min();
+
+// Unsigned comparison first <= ch <= last, SSE2 compares only signed numbers
+static __m128i in_range_sse2(__m128i chars, char32_t first, char32_t last) {
+    auto offset = _mm_sub_epi32(chars, _mm_set1_epi32(static_cast<int32_t>(first)));
+    auto biased = _mm_xor_si128(offset, _mm_set1_epi32(SIGN_BIT));
+    auto limit = _mm_set1_epi32(SIGN_BIT + static_cast<int32_t>(last - first + 1));
+    return _mm_cmplt_epi32(biased, limit);
+}
+
+static __m128i is_identity_sse2(__m128i chars) {
+    auto [first_low, last_low] = IDENTITY_RANGES[0];
+    auto [first_high, last_high] = IDENTITY_RANGES[1];
+    return _mm_or_si128(in_range_sse2(chars, first_low, last_low),
+                        in_range_sse2(chars, first_high, last_high));
+}
+
+void chars_to_keysyms_sse2(std::u32string_view chars, uint32_t *key_syms) {
+    constexpr size_t BLOCK_SIZE = 8;
+    constexpr auto ALL_LANES = 0xFFFF;
+    const auto *data = chars.data();
+    size_t i = 0;
+    for (; i + BLOCK_SIZE <= chars.size(); i += BLOCK_SIZE) {
+        auto low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        auto high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 4));
+        auto identity = _mm_and_si128(is_identity_sse2(low), is_identity_sse2(high));
+        if (_mm_movemask_epi8(identity) == ALL_LANES) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(key_syms + i), low);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(key_syms + i + 4), high);
+        } else {
+            chars_to_keysyms_scalar(chars.substr(i, BLOCK_SIZE), key_syms + i);
+        }
+    }
+    chars_to_keysyms_scalar(chars.substr(i), key_syms + i);
+}
 
-    return ADD_CODEPOINT + ch;
+__attribute__((target("avx2"))) static __m256i in_range_avx2(__m256i chars, char32_t first,
+                                                             char32_t last) {
+    auto offset = _mm256_sub_epi32(chars, _mm256_set1_epi32(static_cast<int32_t>(first)));
+    auto biased = _mm256_xor_si256(offset, _mm256_set1_epi32(SIGN_BIT));
+    auto limit = _mm256_set1_epi32(SIGN_BIT + static_cast<int32_t>(last - first + 1));
+    return _mm256_cmpgt_epi32(limit, biased);
+}
+
+__attribute__((target("avx2"))) static __m256i is_identity_avx2(__m256i chars) {
+    auto [first_low, last_low] = IDENTITY_RANGES[0];
+    auto [first_high, last_high] = IDENTITY_RANGES[1];
+    return _mm256_or_si256(in_range_avx2(chars, first_low, last_low),
+                           in_range_avx2(chars, first_high, last_high));
+}
+
+__attribute__((target("avx2"))) void chars_to_keysyms_avx2(std::u32string_view chars,
+                                                           uint32_t *key_syms) {
+    constexpr size_t BLOCK_SIZE = 16;
+    constexpr auto ALL_LANES = -1;
+    const auto *data = chars.data();
+    size_t i = 0;
+    for (; i + BLOCK_SIZE <= chars.size(); i += BLOCK_SIZE) {
+        auto low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        auto high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 8));
+        auto identity = _mm256_and_si256(is_identity_avx2(low), is_identity_avx2(high));
+        if (_mm256_movemask_epi8(identity) == ALL_LANES) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(key_syms + i), low);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(key_syms + i + 8), high);
+        } else {
+            chars_to_keysyms_scalar(chars.substr(i, BLOCK_SIZE), key_syms + i);
+        }
+    }
+    chars_to_keysyms_scalar(chars.substr(i), key_syms + i);
+}
+
+// NOLINTEND(*-reinterpret-cast,*-pointer-arithmetic)
+
+bool cpu_supports_avx2() {
+    static const auto supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    return supported;
+}
+
+#endif
+
+void chars_to_keysyms(std::u32string_view chars, uint32_t *key_syms) {
+#if KEYBOARD_AUTO_TYPE_X86_SIMD
+    if (cpu_supports_avx2()) {
+        chars_to_keysyms_avx2(chars, key_syms);
+    } else {
+        chars_to_keysyms_sse2(chars, key_syms);
+    }
+#else
+    chars_to_keysyms_scalar(chars, key_syms);
+#endif
 }
 
 } // namespace keyboard_auto_type
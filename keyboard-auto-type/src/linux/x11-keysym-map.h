@@ -1,9 +1,29 @@
 #pragma once
 
 #include <cstdint>
+#include <string_view>
+
+// SSE2 is always available on x86-64, AVX2 is checked at runtime
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define KEYBOARD_AUTO_TYPE_X86_SIMD 1
+#else
+#define KEYBOARD_AUTO_TYPE_X86_SIMD 0
+#endif
 
 namespace keyboard_auto_type {
 
 uint32_t char_to_keysym(char32_t ch);
 
+// Converts a whole string, key_syms must have space for chars.size() elements
+// The fastest implementation supported by the CPU is used
+void chars_to_keysyms(std::u32string_view chars, uint32_t *key_syms);
+
+// Implementations selected by chars_to_keysyms, exposed for benchmarks
+void chars_to_keysyms_scalar(std::u32string_view chars, uint32_t *key_syms);
+#if KEYBOARD_AUTO_TYPE_X86_SIMD
+void chars_to_keysyms_sse2(std::u32string_view chars, uint32_t *key_syms);
+void chars_to_keysyms_avx2(std::u32string_view chars, uint32_t *key_syms);
+bool cpu_supports_avx2();
+#endif
+
 } // namespace keyboard_auto_type
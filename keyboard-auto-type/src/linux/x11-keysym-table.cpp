@@ -0,0 +1,167 @@
+#include "x11-keysym-table.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace keyboard_auto_type {
+
+void X11KeySymTable::reserve(size_t count) {
+    own();
+    // the load factor is kept under 1/2, so that probe sequences stay short
+    auto capacity = MIN_CAPACITY;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    if (capacity > entries_.size()) {
+        rehash(capacity);
+    }
+}
+
+void X11KeySymTable::clear() {
+    view_direct_ = nullptr;
+    view_entries_ = nullptr;
+    set_capacity(entries_.size());
+    direct_.fill({});
+    std::fill(entries_.begin(), entries_.end(), Entry{});
+    size_ = 0;
+}
+
+void X11KeySymTable::set_capacity(size_t capacity) {
+    capacity_ = capacity;
+    hash_shift_ = HASH_BITS;
+    for (auto size = capacity; size > 1; size /= 2) {
+        hash_shift_--;
+    }
+}
+
+void X11KeySymTable::rehash(size_t capacity) {
+    auto old_entries = std::move(entries_);
+    entries_.assign(capacity, Entry{});
+    set_capacity(capacity);
+    auto mask = capacity - 1;
+    for (const auto &entry : old_entries) {
+        if (!entry.key_sym) {
+            continue;
+        }
+        auto slot = first_slot(entry.key_sym);
+        while (entries_[slot].key_sym) {
+            slot = (slot + 1) & mask;
+        }
+        entries_[slot] = entry;
+    }
+}
+
+void X11KeySymTable::own() {
+    if (!view_direct_) {
+        return;
+    }
+    std::copy_n(view_direct_, direct_.size(), direct_.begin());
+    // NOLINTNEXTLINE(*-pointer-arithmetic)
+    entries_.assign(view_entries_, view_entries_ + capacity_);
+    view_direct_ = nullptr;
+    view_entries_ = nullptr;
+}
+
+void X11KeySymTable::insert_or_assign(KeySym key_sym, KeyCodeWithMask key) {
+    own();
+    if (key_sym < DIRECT_KEY_SYMS) {
+        auto &direct_key = direct_[key_sym]; // NOLINT(*-constant-array-index)
+        if (!direct_key.key_code) {
+            size_++;
+        }
+        direct_key = key;
+        return;
+    }
+    if ((size_ + 1) * 2 > entries_.size()) {
+        rehash(std::max(MIN_CAPACITY, entries_.size() * 2));
+    }
+    auto mask = entries_.size() - 1;
+    auto slot = first_slot(key_sym);
+    while (entries_[slot].key_sym && entries_[slot].key_sym != key_sym) {
+        slot = (slot + 1) & mask;
+    }
+    auto &entry = entries_[slot];
+    if (!entry.key_sym) {
+        entry.key_sym = static_cast<uint32_t>(key_sym);
+        size_++;
+    }
+    entry.key = key;
+}
+
+size_t X11KeySymTable::saved_size() const {
+    // the entries follow the direct keys, they're 4-byte aligned, so the direct keys are padded
+    auto direct_size = (DIRECT_KEY_SYMS * sizeof(KeyCodeWithMask) + 3) & ~size_t{3};
+    return sizeof(SavedHeader) + direct_size + capacity_ * sizeof(Entry);
+}
+
+void X11KeySymTable::save(uint8_t *data) const {
+    // NOLINTBEGIN(*-pointer-arithmetic)
+    SavedHeader header{};
+    header.size = static_cast<uint32_t>(size_);
+    header.capacity = static_cast<uint32_t>(capacity_);
+    std::memcpy(data, &header, sizeof(header));
+    data += sizeof(header);
+
+    auto direct_size = DIRECT_KEY_SYMS * sizeof(KeyCodeWithMask);
+    auto padded_direct_size = (direct_size + 3) & ~size_t{3};
+    std::memcpy(data, direct(), direct_size);
+    std::memset(data + direct_size, 0, padded_direct_size - direct_size);
+    data += padded_direct_size;
+
+    for (size_t slot = 0; slot < capacity_; slot++) {
+        Entry entry{};
+        entry.key_sym = entries()[slot].key_sym;
+        entry.key = entries()[slot].key;
+        std::memcpy(data + slot * sizeof(entry), &entry, sizeof(entry));
+    }
+    // NOLINTEND(*-pointer-arithmetic)
+}
+
+size_t X11KeySymTable::view(const uint8_t *data, size_t size) {
+    // NOLINTBEGIN(*-pointer-arithmetic,*-reinterpret-cast)
+    SavedHeader header{};
+    if (size < sizeof(header) || reinterpret_cast<uintptr_t>(data) % alignof(Entry)) {
+        return 0;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    auto capacity = static_cast<size_t>(header.capacity);
+    auto is_power_of_two = !(capacity & (capacity - 1));
+    if (!is_power_of_two || header.size > DIRECT_KEY_SYMS + capacity / 2) {
+        return 0;
+    }
+    auto direct_size = (DIRECT_KEY_SYMS * sizeof(KeyCodeWithMask) + 3) & ~size_t{3};
+    auto saved_size = sizeof(header) + direct_size + capacity * sizeof(Entry);
+    if (size < saved_size) {
+        return 0;
+    }
+    // entries must have empty slots, otherwise a lookup of a missing key sym never ends
+    const auto *entries = reinterpret_cast<const Entry *>(data + sizeof(header) + direct_size);
+    if (capacity && std::none_of(entries, entries + capacity,
+                                 [](const auto &entry) { return !entry.key_sym; })) {
+        return 0;
+    }
+
+    clear();
+    view_direct_ = reinterpret_cast<const KeyCodeWithMask *>(data + sizeof(header));
+    view_entries_ = entries;
+    set_capacity(capacity);
+    size_ = header.size;
+    return saved_size;
+    // NOLINTEND(*-pointer-arithmetic,*-reinterpret-cast)
+}
+
+bool X11KeySymTable::operator==(const X11KeySymTable &other) const {
+    const auto *direct = this->direct();
+    // NOLINTNEXTLINE(*-pointer-arithmetic)
+    if (size_ != other.size_ || !std::equal(direct, direct + DIRECT_KEY_SYMS, other.direct())) {
+        return false;
+    }
+    auto equal = true;
+    for_each([&](KeySym key_sym, const KeyCodeWithMask &key) {
+        const auto *other_key = other.find(key_sym);
+        equal = equal && other_key && *other_key == key;
+    });
+    return equal;
+}
+
+} // namespace keyboard_auto_type
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace keyboard_auto_type {
+
+struct KeyCodeWithMask {
+    uint8_t key_code = 0;
+    uint8_t group = 0;
+    uint8_t mod_mask = 0;
+};
+
+inline bool operator==(const KeyCodeWithMask &a, const KeyCodeWithMask &b) {
+    return a.key_code == b.key_code && a.group == b.group && a.mod_mask == b.mod_mask;
+}
+
+inline bool operator!=(const KeyCodeWithMask &a, const KeyCodeWithMask &b) { return !(a == b); }
+
+// Maps key syms to key codes: Latin-1 key syms are looked up in an array by index,
+// the rest in an open-addressing hash table, there are no allocations per entry
+// The table can be saved as is and used in place from memory it doesn't own, such as a mapped file
+class X11KeySymTable {
+  private:
+    static constexpr KeySym DIRECT_KEY_SYMS = 0x100;
+    static constexpr size_t MIN_CAPACITY = 64;
+    static constexpr uint64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+    static constexpr unsigned HASH_BITS = 64;
+
+    struct Entry {
+        uint32_t key_sym = 0; // 0 means the slot is empty
+        KeyCodeWithMask key;
+        uint8_t padding = 0;
+    };
+
+    // saved before the arrays, followed by direct keys and capacity entries
+    struct SavedHeader {
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+    };
+
+    static_assert(sizeof(Entry) == 8);
+    static_assert(sizeof(SavedHeader) == 8);
+
+    // key_code 0 means there's no key, valid key codes start from 8
+    std::array<KeyCodeWithMask, DIRECT_KEY_SYMS> direct_{};
+    std::vector<Entry> entries_;
+    // not null if the table is a view of a saved one
+    const KeyCodeWithMask *view_direct_ = nullptr;
+    const Entry *view_entries_ = nullptr;
+    size_t capacity_ = 0;
+    unsigned hash_shift_ = HASH_BITS;
+    size_t size_ = 0;
+
+    [[nodiscard]] size_t first_slot(KeySym key_sym) const {
+        return static_cast<size_t>((key_sym * HASH_MULTIPLIER) >> hash_shift_);
+    }
+    [[nodiscard]] const KeyCodeWithMask *direct() const {
+        return view_direct_ ? view_direct_ : direct_.data();
+    }
+    [[nodiscard]] const Entry *entries() const {
+        return view_entries_ ? view_entries_ : entries_.data();
+    }
+    void set_capacity(size_t capacity);
+    void rehash(size_t capacity);
+    // copies the viewed table, so that it can be changed
+    void own();
+
+  public:
+    void reserve(size_t count);
+    void clear();
+    void insert_or_assign(KeySym key_sym, KeyCodeWithMask key);
+
+    // Number of bytes written by save
+    [[nodiscard]] size_t saved_size() const;
+    // Writes the table to saved_size() bytes at data, aligned to 4 bytes
+    void save(uint8_t *data) const;
+    // Uses the table saved at data without copying it, the memory must outlive the table,
+    // returns the number of bytes taken by the table or 0 if it's damaged
+    size_t view(const uint8_t *data, size_t size);
+
+    [[nodiscard]] const KeyCodeWithMask *find(KeySym key_sym) const {
+        if (key_sym < DIRECT_KEY_SYMS) {
+            const auto &key = direct()[key_sym]; // NOLINT(*-pointer-arithmetic)
+            return key.key_code ? &key : nullptr;
+        }
+        if (!capacity_) {
+            return nullptr;
+        }
+        const auto *entries = this->entries();
+        auto mask = capacity_ - 1;
+        for (auto slot = first_slot(key_sym);; slot = (slot + 1) & mask) {
+            const auto &entry = entries[slot]; // NOLINT(*-pointer-arithmetic)
+            if (entry.key_sym == key_sym) {
+                return &entry.key;
+            }
+            if (!entry.key_sym) {
+                return nullptr;
+            }
+        }
+    }
+
+    [[nodiscard]] bool contains(KeySym key_sym) const { return find(key_sym) != nullptr; }
+    [[nodiscard]] size_t size() const { return size_; }
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+
+    template <typename Fn> void for_each(Fn fn) const {
+        const auto *direct = this->direct();
+        for (KeySym key_sym = 0; key_sym < DIRECT_KEY_SYMS; key_sym++) {
+            const auto &key = direct[key_sym]; // NOLINT(*-pointer-arithmetic)
+            if (key.key_code) {
+                fn(key_sym, key);
+            }
+        }
+        const auto *entries = this->entries();
+        for (size_t slot = 0; slot < capacity_; slot++) {
+            const auto &entry = entries[slot]; // NOLINT(*-pointer-arithmetic)
+            if (entry.key_sym) {
+                fn(static_cast<KeySym>(entry.key_sym), entry.key);
+            }
+        }
+    }
+
+    bool operator==(const X11KeySymTable &other) const;
+    bool operator!=(const X11KeySymTable &other) const { return !(*this == other); }
+};
+
+} // namespace keyboard_auto_type
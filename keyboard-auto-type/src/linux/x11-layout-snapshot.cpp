@@ -0,0 +1,393 @@
+#include "x11-layout-snapshot.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace keyboard_auto_type {
+
+constexpr uint32_t SNAPSHOT_MAGIC = 0x4C54'414B; // "KATL"
+// must be incremented when the format or the way layouts are built changes
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+constexpr uint64_t FNV_OFFSET_BASIS = 0xCBF2'9CE4'8422'2325ULL;
+constexpr uint64_t FNV_PRIME = 0x0000'0100'0000'01B3ULL;
+constexpr mode_t SNAPSHOT_DIR_MODE = 0700;
+// enough for a few layouts used together, older keymaps are unlikely to come back
+constexpr size_t MAX_SNAPSHOTS = 16;
+// temporary files left by a crashed process are removed after this time
+constexpr time_t STALE_TEMP_FILE_AGE = 60 * 60;
+constexpr size_t KEY_CODES_COUNT = 256;
+
+// File format: the header, hashes of all key codes, the table of the active group,
+// the table of other groups, empty_key_codes_count bytes of empty key codes
+// The tables are saved by X11KeySymTable::save and used in place
+struct SnapshotHeader {
+    uint32_t magic = SNAPSHOT_MAGIC;
+    uint32_t version = SNAPSHOT_VERSION;
+    uint64_t keymap_id = 0;
+    uint64_t keymap_hash = 0;
+    uint8_t group = 0;
+    uint8_t padding = 0;
+    uint16_t empty_key_codes_count = 0;
+    uint32_t padding2 = 0;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32);
+
+namespace {
+
+// FNV-1a, over 64-bit words instead of bytes
+class Fnv1a {
+  private:
+    uint64_t hash_ = FNV_OFFSET_BASIS;
+
+  public:
+    void add(uint64_t value) { hash_ = (hash_ ^ value) * FNV_PRIME; }
+    [[nodiscard]] uint64_t hash() const { return hash_; }
+};
+
+} // namespace
+
+uint64_t x11_keymap_id(Display *display) {
+    XkbDescHandle kbd(XkbAllocKeyboard());
+    if (!kbd) {
+        return 0;
+    }
+    auto names_mask = XkbKeycodesNameMask | XkbTypesNameMask | XkbSymbolsNameMask;
+    if (XkbGetNames(display, names_mask, kbd.get()) != Success || !kbd->names) {
+        return 0;
+    }
+    std::array<Atom, 3> atoms{kbd->names->keycodes, kbd->names->types, kbd->names->symbols};
+    if (std::find(atoms.begin(), atoms.end(), None) != atoms.end()) {
+        // keymaps without names can't be told apart
+        return 0;
+    }
+    std::array<char *, 3> names{};
+    if (!XGetAtomNames(display, atoms.data(), atoms.size(), names.data())) {
+        return 0;
+    }
+
+    Fnv1a hash;
+    for (auto *name : names) {
+        for (const auto *ch = name; *ch; ch++) { // NOLINT(*-pointer-arithmetic)
+            hash.add(static_cast<uint8_t>(*ch));
+        }
+        // names are separated, so that "ab" + "c" is not the same as "a" + "bc"
+        hash.add(0);
+        XFree(name);
+    }
+    auto min_key_code = 0;
+    auto max_key_code = 0;
+    XDisplayKeycodes(display, &min_key_code, &max_key_code);
+    hash.add(min_key_code);
+    hash.add(max_key_code);
+    return hash.hash() ? hash.hash() : 1;
+}
+
+uint64_t x11_key_hash(XkbDescPtr kbd, uint16_t key_code, const X11ReservedKeys &reserved_keys) {
+    // only the key sym map of the key is used, it's all we get when the key is checked
+    Fnv1a hash;
+    auto width = XkbKeyGroupsWidth(kbd, key_code);
+    auto key_groups_num = XkbKeyNumGroups(kbd, key_code);
+    for (auto group = 0; group < key_groups_num; group++) {
+        if (reserved_keys.is_reserved_group(group)) {
+            continue;
+        }
+        hash.add(group);
+        hash.add(XkbKeyKeyTypeIndex(kbd, key_code, group));
+        for (auto shift_level = 0; shift_level < width; shift_level++) {
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            hash.add(XkbKeySymEntry(kbd, key_code, shift_level, group));
+        }
+    }
+    return hash.hash();
+}
+
+uint64_t x11_keymap_hash(const std::vector<uint64_t> &key_hashes) {
+    Fnv1a hash;
+    for (auto key_hash : key_hashes) {
+        hash.add(key_hash);
+    }
+    return hash.hash();
+}
+
+X11LayoutSnapshot::X11LayoutSnapshot(std::shared_ptr<const uint8_t> data,
+                                     const uint8_t *key_hashes)
+    : data_(std::move(data)), key_hashes_(key_hashes) {}
+
+uint64_t X11LayoutSnapshot::key_hash(uint8_t key_code) const {
+    uint64_t hash = 0;
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    std::memcpy(&hash, key_hashes_ + key_code * sizeof(hash), sizeof(hash));
+    return hash;
+}
+
+bool X11LayoutSnapshot::is_checked(uint8_t key_code) const {
+    return checked_key_codes_.at(key_code / KEY_CODES_PER_WORD) &
+           (uint64_t{1} << (key_code % KEY_CODES_PER_WORD));
+}
+
+void X11LayoutSnapshot::set_checked(uint8_t key_code) {
+    checked_key_codes_.at(key_code / KEY_CODES_PER_WORD) |=
+        uint64_t{1} << (key_code % KEY_CODES_PER_WORD);
+}
+
+static std::string snapshot_dir() {
+    const auto *cache_home = std::getenv("XDG_CACHE_HOME"); // NOLINT(concurrency-mt-unsafe)
+    if (cache_home && *cache_home) {
+        return std::string(cache_home) + "/keyboard-auto-type";
+    }
+    const auto *home = std::getenv("HOME"); // NOLINT(concurrency-mt-unsafe)
+    if (home && *home) {
+        return std::string(home) + "/.cache/keyboard-auto-type";
+    }
+    return {};
+}
+
+static std::string snapshot_path(const std::string &dir, uint64_t keymap_id, uint8_t group) {
+    std::array<char, 64> file_name{};
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-vararg)
+    std::snprintf(file_name.data(), file_name.size(), "/layout-%016" PRIx64 "-%u.bin", keymap_id,
+                  static_cast<unsigned>(group));
+    return dir + file_name.data();
+}
+
+std::shared_ptr<X11KeyboardLayout> x11_parse_layout_snapshot(std::shared_ptr<const uint8_t> data,
+                                                              size_t size, uint64_t keymap_id,
+                                                              uint8_t group) {
+    // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    SnapshotHeader header{};
+    constexpr auto KEY_HASHES_SIZE = KEY_CODES_COUNT * sizeof(uint64_t);
+    if (size < sizeof(header) + KEY_HASHES_SIZE) {
+        return nullptr;
+    }
+    std::memcpy(&header, data.get(), sizeof(header));
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        header.keymap_id != keymap_id || header.group != group) {
+        return nullptr;
+    }
+
+    const auto *key_hashes = data.get() + sizeof(header);
+    auto offset = sizeof(header) + KEY_HASHES_SIZE;
+    X11KeySymTable keys;
+    auto keys_size = keys.view(data.get() + offset, size - offset);
+    if (!keys_size) {
+        return nullptr;
+    }
+    offset += keys_size;
+    X11KeySymTable inactive_group_keys;
+    auto inactive_group_keys_size = inactive_group_keys.view(data.get() + offset, size - offset);
+    if (!inactive_group_keys_size) {
+        return nullptr;
+    }
+    offset += inactive_group_keys_size;
+    if (size - offset != header.empty_key_codes_count) {
+        return nullptr;
+    }
+
+    auto layout = std::make_shared<X11KeyboardLayout>();
+    layout->group = group;
+    layout->keymap_id = keymap_id;
+    layout->keymap_hash = header.keymap_hash;
+    layout->keys = std::move(keys);
+    layout->inactive_group_keys.assign(std::move(inactive_group_keys));
+    layout->empty_key_codes.assign(data.get() + offset, data.get() + size);
+    layout->snapshot = std::make_shared<X11LayoutSnapshot>(std::move(data), key_hashes);
+    return layout;
+    // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+std::shared_ptr<X11KeyboardLayout> x11_load_layout_snapshot(uint64_t keymap_id, uint8_t group) {
+    auto dir = snapshot_dir();
+    if (dir.empty()) {
+        return nullptr;
+    }
+    auto path = snapshot_path(dir, keymap_id, group);
+
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC); // NOLINT(*-vararg)
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat file_stat {};
+    void *data = MAP_FAILED;
+    size_t size = 0;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+        size = static_cast<size_t>(file_stat.st_size);
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) { // NOLINT(*-cstyle-cast,performance-no-int-to-ptr)
+        return nullptr;
+    }
+
+    // the file is replaced by renaming a new one, so the mapped contents never change
+    std::shared_ptr<const uint8_t> mapped_data(
+        static_cast<const uint8_t *>(data), [size](const uint8_t *mapped) {
+            munmap(const_cast<uint8_t *>(mapped), size); // NOLINT(*-const-cast)
+        });
+    return x11_parse_layout_snapshot(std::move(mapped_data), size, keymap_id, group);
+}
+
+bool x11_match_snapshot_keys(XkbDescPtr kbd, X11LayoutSnapshot &snapshot, uint8_t first_key_code,
+                             uint8_t last_key_code, const X11ReservedKeys &reserved_keys) {
+    if (first_key_code < kbd->min_key_code || last_key_code > kbd->max_key_code) {
+        return false;
+    }
+    for (uint16_t key_code = first_key_code; key_code <= last_key_code; key_code++) {
+        if (snapshot.is_checked(key_code) || reserved_keys.is_reserved_key_code(key_code)) {
+            // our mappings are not in the snapshot, the key was empty before
+            continue;
+        }
+        if (x11_key_hash(kbd, key_code, reserved_keys) != snapshot.key_hash(key_code)) {
+            return false;
+        }
+        snapshot.set_checked(key_code);
+    }
+    return true;
+}
+
+bool x11_check_snapshot_keys(Display *display, X11LayoutSnapshot &snapshot,
+                             uint8_t first_key_code, uint8_t last_key_code,
+                             const X11ReservedKeys &reserved_keys) {
+    // an empty map, only key syms of the range are fetched to it, types are not needed
+    XkbDescHandle kbd(XkbAllocKeyboard());
+    if (!kbd) {
+        return false;
+    }
+    auto min_key_code = 0;
+    auto max_key_code = 0;
+    XDisplayKeycodes(display, &min_key_code, &max_key_code);
+    kbd->min_key_code = static_cast<KeyCode>(min_key_code);
+    kbd->max_key_code = static_cast<KeyCode>(max_key_code);
+    if (XkbAllocClientMap(kbd.get(), XkbKeySymsMask, 0) != Success ||
+        XkbGetKeySyms(display, first_key_code, last_key_code - first_key_code + 1, kbd.get()) !=
+            Success) {
+        return false;
+    }
+    return x11_match_snapshot_keys(kbd.get(), snapshot, first_key_code, last_key_code,
+                                   reserved_keys);
+}
+
+static void prune_snapshots(const std::string &dir, const std::string &saved_path) {
+    constexpr std::string_view FILE_NAME_PREFIX = "layout-";
+    constexpr std::string_view FILE_NAME_SUFFIX = ".bin";
+
+    auto *dir_stream = opendir(dir.c_str());
+    if (!dir_stream) {
+        return;
+    }
+    auto now = time(nullptr);
+    // modification time in nanoseconds, several snapshots can be saved within a second
+    std::vector<std::pair<int64_t, std::string>> snapshots;
+    while (const auto *entry = readdir(dir_stream)) { // NOLINT(concurrency-mt-unsafe)
+        std::string_view file_name(entry->d_name);
+        if (file_name.substr(0, FILE_NAME_PREFIX.size()) != FILE_NAME_PREFIX) {
+            continue;
+        }
+        auto path = dir + '/' + std::string(file_name);
+        struct stat file_stat {};
+        if (stat(path.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+        auto is_snapshot = file_name.size() >= FILE_NAME_SUFFIX.size() &&
+                           file_name.substr(file_name.size() - FILE_NAME_SUFFIX.size()) ==
+                               FILE_NAME_SUFFIX;
+        if (!is_snapshot) {
+            if (now - file_stat.st_mtime > STALE_TEMP_FILE_AGE) {
+                unlink(path.c_str());
+            }
+        } else if (path != saved_path) {
+            constexpr int64_t NS_PER_SECOND = 1'000'000'000;
+            snapshots.emplace_back(
+                static_cast<int64_t>(file_stat.st_mtim.tv_sec) * NS_PER_SECOND +
+                    file_stat.st_mtim.tv_nsec,
+                std::move(path));
+        }
+    }
+    closedir(dir_stream);
+
+    // the one just saved is kept in any case
+    if (snapshots.size() < MAX_SNAPSHOTS) {
+        return;
+    }
+    // the most recently saved first
+    std::sort(snapshots.begin(), snapshots.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (auto it = snapshots.begin() + MAX_SNAPSHOTS - 1; it != snapshots.end(); ++it) {
+        unlink(it->second.c_str());
+    }
+}
+
+void x11_save_layout_snapshot(const X11KeyboardLayout &layout) {
+    if (!layout.keymap_id || layout.key_hashes.size() != KEY_CODES_COUNT) {
+        return;
+    }
+    auto dir = snapshot_dir();
+    if (dir.empty()) {
+        return;
+    }
+    // the parent is usually there, if not, it's created as well
+    auto parent_dir = dir.substr(0, dir.rfind('/'));
+    mkdir(parent_dir.c_str(), SNAPSHOT_DIR_MODE);
+    mkdir(dir.c_str(), SNAPSHOT_DIR_MODE);
+
+    // inactive groups are built here, so that the next process doesn't need the key sym map
+    const auto &inactive_group_keys = layout.inactive_group_keys.keys();
+
+    SnapshotHeader header{};
+    header.keymap_id = layout.keymap_id;
+    header.keymap_hash = layout.keymap_hash;
+    header.group = layout.group;
+    header.empty_key_codes_count = static_cast<uint16_t>(layout.empty_key_codes.size());
+
+    auto key_hashes_size = layout.key_hashes.size() * sizeof(uint64_t);
+    std::vector<uint8_t> data(sizeof(header) + key_hashes_size + layout.keys.saved_size() +
+                              inactive_group_keys.saved_size() + layout.empty_key_codes.size());
+    // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    auto *out = data.data();
+    std::memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+    std::memcpy(out, layout.key_hashes.data(), key_hashes_size);
+    out += key_hashes_size;
+    layout.keys.save(out);
+    out += layout.keys.saved_size();
+    inactive_group_keys.save(out);
+    out += inactive_group_keys.saved_size();
+    std::copy(layout.empty_key_codes.begin(), layout.empty_key_codes.end(), out);
+    // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+
+    // written to a temporary file and renamed, so that other processes never see a partial file,
+    // the name is unique, so that threads and processes saving the same layout don't collide
+    // a stale snapshot of the same keymap is replaced, processes which have mapped it keep
+    // the old contents
+    auto path = snapshot_path(dir, layout.keymap_id, layout.group);
+    auto temp_path = path + ".XXXXXX";
+    auto fd = mkostemp(temp_path.data(), O_CLOEXEC); // created with 0600
+    if (fd < 0) {
+        return;
+    }
+    auto written = write(fd, data.data(), data.size());
+    close(fd);
+    if (written != static_cast<ssize_t>(data.size()) || rename(temp_path.c_str(), path.c_str())) {
+        unlink(temp_path.c_str());
+        return;
+    }
+
+    prune_snapshots(dir, path);
+}
+
+} // namespace keyboard_auto_type
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <X11/XKBlib.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "x11-keyboard-layout.h"
+
+namespace keyboard_auto_type {
+
+// Layouts are saved to the user cache directory, so that a new process takes the layout
+// from a memory-mapped file instead of fetching the key sym map and building the layout
+// A snapshot is found by the names of the keymap components, which don't change if single keys
+// are remapped, so each key of the snapshot is checked against the server when it's first used
+
+// Identifies the keymap by the names of its key codes, types and symbols and the key code range,
+// 0 if the keymap has no names
+uint64_t x11_keymap_id(Display *display);
+
+// Hash of the key syms and key types of the key, used to check the key later,
+// the reserved group is skipped, it's changed only by us
+uint64_t x11_key_hash(XkbDescPtr kbd, uint16_t key_code, const X11ReservedKeys &reserved_keys);
+
+// Hash of the whole keymap made of the hashes of its keys
+uint64_t x11_keymap_hash(const std::vector<uint64_t> &key_hashes);
+
+// Snapshot file mapped to memory, tables of the layout read from it point to its data
+// Keys are checked by the typing thread of any instance using the layout, once for all of them
+class X11LayoutSnapshot {
+  private:
+    static constexpr size_t KEY_CODES_PER_WORD = 64;
+    std::shared_ptr<const uint8_t> data_;
+    // hashes of the keys at the time the snapshot was saved, indexed by key code
+    const uint8_t *key_hashes_ = nullptr;
+    std::array<std::atomic<uint64_t>, 256 / KEY_CODES_PER_WORD> checked_key_codes_{};
+
+  public:
+    X11LayoutSnapshot(std::shared_ptr<const uint8_t> data, const uint8_t *key_hashes);
+
+    [[nodiscard]] uint64_t key_hash(uint8_t key_code) const;
+    [[nodiscard]] bool is_checked(uint8_t key_code) const;
+    void set_checked(uint8_t key_code);
+};
+
+// Returns the saved layout for this keymap if there's one, nothing is fetched from the server
+std::shared_ptr<X11KeyboardLayout> x11_load_layout_snapshot(uint64_t keymap_id, uint8_t group);
+
+// Parses the snapshot file contents without copying the tables, the layout keeps the data,
+// returns null if it's not for this keymap or it's damaged
+std::shared_ptr<X11KeyboardLayout> x11_parse_layout_snapshot(std::shared_ptr<const uint8_t> data,
+                                                              size_t size, uint64_t keymap_id,
+                                                              uint8_t group);
+
+// Compares the keys from first_key_code to last_key_code in kbd with the snapshot,
+// keys not checked before are marked as checked, returns false if any of them has changed
+bool x11_match_snapshot_keys(XkbDescPtr kbd, X11LayoutSnapshot &snapshot, uint8_t first_key_code,
+                             uint8_t last_key_code, const X11ReservedKeys &reserved_keys);
+
+// Fetches key syms of the key code range with one request and matches them with the snapshot,
+// returns false if a key has changed or the keys can't be fetched
+bool x11_check_snapshot_keys(Display *display, X11LayoutSnapshot &snapshot,
+                             uint8_t first_key_code, uint8_t last_key_code,
+                             const X11ReservedKeys &reserved_keys);
+
+// Saves the layout with all its groups, errors are ignored, the snapshot is only an optimization
+// Snapshots of other keymaps are removed, except for a few most recently saved ones
+void x11_save_layout_snapshot(const X11KeyboardLayout &layout);
+
+} // namespace keyboard_auto_type
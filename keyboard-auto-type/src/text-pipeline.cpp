@@ -0,0 +1,150 @@
+#include "text-pipeline.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace keyboard_auto_type {
+
+TextPipeline::TextPipeline() : worker_([this] { run_worker(); }) {}
+
+TextPipeline::~TextPipeline() {
+    stopping_ = true;
+    notify();
+    worker_.join();
+}
+
+void TextPipeline::start(TextReader &reader, std::u32string_view first_chunk,
+                         BackgroundKeyResolver key_resolver) {
+    // the worker is waiting for the next text, so nothing else uses the ring now
+    chunks_.reset();
+    has_read_slot_ = false;
+    cancelled_ = false;
+    result_ = AutoTypeResult::Ok;
+    error_.clear();
+    exception_ = nullptr;
+    reader_ = &reader;
+    key_resolver_ = std::move(key_resolver);
+
+    // copied before the worker starts, the next read reuses the reader's buffer
+    auto *chunk = chunks_.write_slot();
+    chunk->size = first_chunk.size();
+    chunk->keys_resolved = false;
+    std::copy(first_chunk.begin(), first_chunk.end(), chunk->chars.begin());
+    chunks_.commit_write();
+
+    {
+        std::lock_guard lock(wait_mutex_);
+        reading_ = true;
+    }
+    wait_cv_.notify_all();
+}
+
+void TextPipeline::finish() {
+    cancelled_ = true;
+    std::unique_lock lock(wait_mutex_);
+    wait_cv_.notify_all();
+    wait_cv_.wait(lock, [&] { return !reading_; });
+    reader_ = nullptr;
+    key_resolver_ = nullptr;
+}
+
+void TextPipeline::notify() {
+    std::lock_guard lock(wait_mutex_);
+    wait_cv_.notify_all();
+}
+
+ResolvedTextChunk &TextPipeline::next() {
+    if (has_read_slot_) {
+        chunks_.commit_read();
+        notify();
+    }
+    ResolvedTextChunk *chunk = nullptr;
+    {
+        std::unique_lock lock(wait_mutex_);
+        wait_cv_.wait(lock, [&] { return (chunk = chunks_.read_slot()) != nullptr; });
+    }
+    has_read_slot_ = true;
+    return *chunk;
+}
+
+void TextPipeline::run_worker() {
+    while (true) {
+        {
+            std::unique_lock lock(wait_mutex_);
+            wait_cv_.wait(lock, [&] { return stopping_ || reading_; });
+        }
+        if (stopping_) {
+            return;
+        }
+        read_text();
+        {
+            std::lock_guard lock(wait_mutex_);
+            reading_ = false;
+        }
+        wait_cv_.notify_all();
+    }
+}
+
+void TextPipeline::read_text() {
+    while (true) {
+        ResolvedTextChunk *chunk = nullptr;
+        {
+            std::unique_lock lock(wait_mutex_);
+            wait_cv_.wait(lock, [&] {
+                return stopping_ || cancelled_ || (chunk = chunks_.write_slot()) != nullptr;
+            });
+        }
+        if (stopping_ || cancelled_) {
+            return;
+        }
+
+        auto result = AutoTypeResult::Ok;
+#if __cpp_exceptions
+        try {
+#endif
+            result = read_chunk(*chunk);
+#if __cpp_exceptions
+        } catch (...) {
+            result = AutoTypeResult::OsError;
+            exception_ = std::current_exception();
+        }
+#endif
+        if (result != AutoTypeResult::Ok) {
+            result_ = result;
+            chunk->size = 0;
+        }
+
+        // the consumer owns the chunk after it's committed
+        auto is_last = !chunk->size;
+        chunks_.commit_write();
+        notify();
+        if (is_last) {
+            return;
+        }
+    }
+}
+
+AutoTypeResult TextPipeline::read_chunk(ResolvedTextChunk &chunk) {
+    std::u32string_view text;
+    auto result = reader_->read(text);
+    if (result != AutoTypeResult::Ok) {
+        error_ = reader_->error();
+        return result;
+    }
+    if (text.size() > chunk.chars.size()) {
+        error_ = "Text chunk is too big";
+        return AutoTypeResult::BadArg;
+    }
+
+    chunk.size = text.size();
+    chunk.keys_resolved = false;
+    std::copy(text.begin(), text.end(), chunk.chars.begin());
+
+    if (key_resolver_ && chunk.size) {
+        // misses are left to the typing thread, it may have a newer layout or map the keys
+        chunk.keys_resolved = key_resolver_(chunk.text(), chunk.keys.data());
+    }
+    return AutoTypeResult::Ok;
+}
+
+} // namespace keyboard_auto_type
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "keyboard-auto-type.h"
+#include "text-reader.h"
+
+namespace keyboard_auto_type {
+
+// Resolves key codes of the text on the pipeline thread, see AutoType::background_key_resolver
+using BackgroundKeyResolver =
+    std::function<bool(std::u32string_view text, PackedKeyCode *key_codes)>;
+
+// Part of the text and key codes of its characters
+struct ResolvedTextChunk {
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> chars{};
+    std::array<PackedKeyCode, TEXT_READER_CHUNK_SIZE> keys{};
+    size_t size = 0;
+    // false if the keys must be resolved by the consumer
+    bool keys_resolved = false;
+
+    [[nodiscard]] std::u32string_view text() const { return {chars.data(), size}; }
+};
+
+// Bounded single-producer single-consumer ring, slots are filled and read in place,
+// so nothing is allocated or copied while it's used
+template <typename T, size_t Capacity> class SpscRing {
+  private:
+    std::array<T, Capacity> slots_{};
+    // numbers of slots written and read so far, the slot index is the number modulo capacity
+    std::atomic<size_t> written_ = 0;
+    std::atomic<size_t> read_ = 0;
+
+  public:
+    // Returns the slot to fill, null if the ring is full
+    T *write_slot() {
+        auto written = written_.load(std::memory_order_relaxed);
+        if (written - read_.load(std::memory_order_acquire) == Capacity) {
+            return nullptr;
+        }
+        return &slots_[written % Capacity];
+    }
+
+    void commit_write() {
+        written_.store(written_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Returns the slot to read, or one written after it, null if it hasn't been written yet
+    T *read_slot(size_t offset = 0) {
+        auto read = read_.load(std::memory_order_relaxed);
+        if (written_.load(std::memory_order_acquire) - read <= offset) {
+            return nullptr;
+        }
+        return &slots_[(read + offset) % Capacity];
+    }
+
+    void commit_read() {
+        read_.store(read_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Empties the ring, neither side must be using it
+    void reset() {
+        written_ = 0;
+        read_ = 0;
+    }
+};
+
+// Reads the text and resolves key codes on a background thread, while the calling thread types
+// the chunks read before, so the first key is sent without waiting for the rest of the text
+// One pipeline is kept by each AutoType instance, its thread waits for the next text between calls
+class TextPipeline {
+  private:
+    static constexpr size_t CHUNKS_IN_FLIGHT = 4;
+
+    TextReader *reader_ = nullptr;
+    // captured when the text is started, empty if keys can't be resolved on another thread
+    BackgroundKeyResolver key_resolver_;
+    SpscRing<ResolvedTextChunk, CHUNKS_IN_FLIGHT> chunks_;
+    bool has_read_slot_ = false;
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    std::atomic<bool> stopping_ = false;
+    // the consumer doesn't need the rest of the text
+    std::atomic<bool> cancelled_ = false;
+    // the worker is reading the text, guarded by wait_mutex_
+    bool reading_ = false;
+    // set by the worker before it publishes the last, empty chunk
+    AutoTypeResult result_ = AutoTypeResult::Ok;
+    std::string error_;
+    std::exception_ptr exception_;
+    std::thread worker_;
+
+    void run_worker();
+    void read_text();
+    AutoTypeResult read_chunk(ResolvedTextChunk &chunk);
+    void notify();
+
+  public:
+    TextPipeline();
+    ~TextPipeline();
+    TextPipeline(const TextPipeline &) = delete;
+    TextPipeline &operator=(const TextPipeline &) = delete;
+    TextPipeline(TextPipeline &&) = delete;
+    TextPipeline &operator=(TextPipeline &&) = delete;
+
+    // Starts reading the text on the worker, first_chunk has already been read by the caller
+    void start(TextReader &reader, std::u32string_view first_chunk,
+               BackgroundKeyResolver key_resolver);
+    // Stops reading if the text is not finished and waits for the worker,
+    // the reader is not used after this call
+    void finish();
+
+    // Waits for the next chunk, the previous one can't be used after this call
+    // An empty chunk means the end of the text or an error, there are no chunks after it
+    ResolvedTextChunk &next();
+    // Returns a chunk following the one returned by next without waiting,
+    // null if it hasn't been read yet, the chunk belongs to the caller as well
+    ResolvedTextChunk *peek(size_t offset) { return chunks_.read_slot(offset); }
+
+    [[nodiscard]] AutoTypeResult result() const { return result_; }
+    [[nodiscard]] const std::string &error() const { return error_; }
+    [[nodiscard]] std::exception_ptr exception() const { return exception_; }
+};
+
+// Finishes the text when it goes out of scope, so that the reader is not used after return
+class TextPipelineGuard {
+  private:
+    TextPipeline &pipeline_;
+
+  public:
+    explicit TextPipelineGuard(TextPipeline &pipeline) : pipeline_(pipeline) {}
+    ~TextPipelineGuard() { pipeline_.finish(); }
+    TextPipelineGuard(const TextPipelineGuard &) = delete;
+    TextPipelineGuard &operator=(const TextPipelineGuard &) = delete;
+    TextPipelineGuard(TextPipelineGuard &&) = delete;
+    TextPipelineGuard &operator=(TextPipelineGuard &&) = delete;
+};
+
+} // namespace keyboard_auto_type
@@ -0,0 +1,305 @@
+#include "text-reader.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define KEYBOARD_AUTO_TYPE_SSE2 1
+#endif
+
+namespace keyboard_auto_type {
+
+constexpr char32_t MAX_CODE_POINT = 0x10FFFF;
+constexpr char32_t FIRST_HIGH_SURROGATE = 0xD800;
+constexpr char32_t FIRST_LOW_SURROGATE = 0xDC00;
+constexpr char32_t LAST_LOW_SURROGATE = 0xDFFF;
+constexpr char32_t FIRST_SUPPLEMENTARY_CODE_POINT = 0x10000;
+constexpr auto SURROGATE_BITS = 10U;
+constexpr uint8_t UTF8_CONTINUATION_MASK = 0xC0;
+constexpr uint8_t UTF8_CONTINUATION = 0x80;
+constexpr uint8_t UTF8_CONTINUATION_BITS_MASK = 0x3F;
+constexpr auto UTF8_CONTINUATION_BITS = 6U;
+constexpr uint8_t MAX_ASCII = 0x7F;
+
+// Lead byte of a UTF-8 sequence: the mask and the value it must have,
+// and the smallest code point that can be encoded with this number of bytes
+struct Utf8Lead {
+    uint8_t mask;
+    uint8_t value;
+    char32_t min_code_point;
+};
+
+constexpr std::array<Utf8Lead, 3> UTF8_LEADS{
+    Utf8Lead{0xE0, 0xC0, 0x80},
+    Utf8Lead{0xF0, 0xE0, 0x800},
+    Utf8Lead{0xF8, 0xF0, 0x10000},
+};
+
+// Returns the number of bytes in a sequence starting with this lead byte, 0 if it's not a lead byte
+static size_t utf8_sequence_length(uint8_t lead) {
+    if (lead <= MAX_ASCII) {
+        return 1;
+    }
+    const auto *lead_info =
+        std::find_if(UTF8_LEADS.begin(), UTF8_LEADS.end(),
+                     [lead](auto info) { return (lead & info.mask) == info.value; });
+    if (lead_info == UTF8_LEADS.end()) {
+        return 0;
+    }
+    return static_cast<size_t>(lead_info - UTF8_LEADS.begin()) + 2;
+}
+
+// Finds the first non-ASCII byte starting from pos, looking at 16 or 8 bytes at a time
+static size_t skip_ascii(const uint8_t *data, size_t size, size_t pos) {
+    // NOLINTBEGIN(*-pointer-arithmetic,*-reinterpret-cast)
+#if KEYBOARD_AUTO_TYPE_SSE2
+    constexpr size_t BLOCK_SIZE = 16;
+    for (; pos + BLOCK_SIZE <= size; pos += BLOCK_SIZE) {
+        auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+        if (_mm_movemask_epi8(block)) {
+            break;
+        }
+    }
+#else
+    constexpr size_t BLOCK_SIZE = 8;
+    constexpr uint64_t HIGH_BITS = 0x8080'8080'8080'8080ULL;
+    for (; pos + BLOCK_SIZE <= size; pos += BLOCK_SIZE) {
+        uint64_t block = 0;
+        std::memcpy(&block, data + pos, BLOCK_SIZE);
+        if (block & HIGH_BITS) {
+            break;
+        }
+    }
+#endif
+    while (pos < size && data[pos] <= MAX_ASCII) {
+        pos++;
+    }
+    return pos;
+    // NOLINTEND(*-pointer-arithmetic,*-reinterpret-cast)
+}
+
+std::optional<size_t> find_invalid_utf8(std::string_view text) {
+    // NOLINTNEXTLINE(*-reinterpret-cast)
+    const auto *data = reinterpret_cast<const uint8_t *>(text.data());
+    auto size = text.size();
+    size_t pos = 0;
+    // NOLINTBEGIN(*-pointer-arithmetic)
+    while (true) {
+        pos = skip_ascii(data, size, pos);
+        if (pos >= size) {
+            return std::nullopt;
+        }
+        auto lead = data[pos];
+        auto length = utf8_sequence_length(lead);
+        if (!length || size - pos < length) {
+            return pos;
+        }
+        char32_t ch = lead & (MAX_ASCII >> length);
+        for (size_t i = 1; i < length; i++) {
+            auto next = data[pos + i];
+            if ((next & UTF8_CONTINUATION_MASK) != UTF8_CONTINUATION) {
+                return pos;
+            }
+            ch = ch << UTF8_CONTINUATION_BITS | (next & UTF8_CONTINUATION_BITS_MASK);
+        }
+        if (ch < UTF8_LEADS.at(length - 2).min_code_point || ch > MAX_CODE_POINT ||
+            (ch >= FIRST_HIGH_SURROGATE && ch <= LAST_LOW_SURROGATE)) {
+            // overlong encoding, too big, or a surrogate
+            return pos;
+        }
+        pos += length;
+    }
+    // NOLINTEND(*-pointer-arithmetic)
+}
+
+// Finds the first surrogate starting from pos, looking at 8 code units at a time
+static size_t skip_non_surrogates(const void *units, size_t size, size_t pos) {
+    // NOLINTBEGIN(*-pointer-arithmetic,*-reinterpret-cast)
+    const auto *data = static_cast<const uint8_t *>(units);
+#if KEYBOARD_AUTO_TYPE_SSE2
+    constexpr size_t BLOCK_SIZE = 8;
+    constexpr auto SURROGATE_MASK = static_cast<int16_t>(0xF800);
+    constexpr auto SURROGATE = static_cast<int16_t>(FIRST_HIGH_SURROGATE);
+    for (; pos + BLOCK_SIZE <= size; pos += BLOCK_SIZE) {
+        auto block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos * 2));
+        auto masked = _mm_and_si128(block, _mm_set1_epi16(SURROGATE_MASK));
+        auto surrogates = _mm_cmpeq_epi16(masked, _mm_set1_epi16(SURROGATE));
+        if (_mm_movemask_epi8(surrogates)) {
+            break;
+        }
+    }
+#endif
+    while (pos < size) {
+        uint16_t unit = 0;
+        std::memcpy(&unit, data + pos * 2, sizeof(unit));
+        if (unit >= FIRST_HIGH_SURROGATE && unit <= LAST_LOW_SURROGATE) {
+            break;
+        }
+        pos++;
+    }
+    return pos;
+    // NOLINTEND(*-pointer-arithmetic,*-reinterpret-cast)
+}
+
+template <typename Char>
+static std::optional<size_t> find_invalid_utf16_units(std::basic_string_view<Char> text) {
+    static_assert(sizeof(Char) == sizeof(char16_t));
+    size_t pos = 0;
+    while (true) {
+        pos = skip_non_surrogates(text.data(), text.size(), pos);
+        if (pos >= text.size()) {
+            return std::nullopt;
+        }
+        auto unit = static_cast<char32_t>(text[pos]);
+        if (unit >= FIRST_LOW_SURROGATE || pos + 1 >= text.size()) {
+            return pos;
+        }
+        auto next = static_cast<char32_t>(text[pos + 1]);
+        if (next < FIRST_LOW_SURROGATE || next > LAST_LOW_SURROGATE) {
+            return pos;
+        }
+        pos += 2;
+    }
+}
+
+std::optional<size_t> find_invalid_utf16(std::u16string_view text) {
+    return find_invalid_utf16_units(text);
+}
+
+std::optional<size_t> find_invalid_utf16(std::wstring_view text) {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+        return find_invalid_utf16_units(text);
+    } else {
+        return std::nullopt;
+    }
+}
+
+// Decodes validated UTF-8 starting from pos until the buffer is full, returns the number of chars
+static size_t decode_utf8(std::string_view text, size_t &pos,
+                          std::array<char32_t, TEXT_READER_CHUNK_SIZE> &buffer) {
+    size_t count = 0;
+    while (count < buffer.size() && pos < text.size()) {
+        auto lead = static_cast<uint8_t>(text[pos]);
+        if (lead <= MAX_ASCII) {
+            buffer.at(count++) = lead;
+            pos++;
+            continue;
+        }
+        auto length = utf8_sequence_length(lead);
+        char32_t ch = lead & (MAX_ASCII >> length);
+        for (size_t i = 1; i < length; i++) {
+            ch = ch << UTF8_CONTINUATION_BITS |
+                 (static_cast<uint8_t>(text[pos + i]) & UTF8_CONTINUATION_BITS_MASK);
+        }
+        buffer.at(count++) = ch;
+        pos += length;
+    }
+    return count;
+}
+
+// Returns the size of the text without the last sequence, if it's incomplete
+static size_t complete_utf8_size(std::string_view text) {
+    // a sequence is up to 4 bytes long, so an incomplete one can take up to 3 last bytes
+    constexpr size_t MAX_INCOMPLETE_SIZE = 3;
+    for (size_t back = 1; back <= std::min(text.size(), MAX_INCOMPLETE_SIZE); back++) {
+        auto byte = static_cast<uint8_t>(text[text.size() - back]);
+        if ((byte & UTF8_CONTINUATION_MASK) == UTF8_CONTINUATION) {
+            continue;
+        }
+        return utf8_sequence_length(byte) > back ? text.size() - back : text.size();
+    }
+    return text.size();
+}
+
+AutoTypeResult Utf8TextReader::read(std::u32string_view &chunk) {
+    auto count = decode_utf8(text_, pos_, buffer_);
+    chunk = std::u32string_view(buffer_.data(), count);
+    return AutoTypeResult::Ok;
+}
+
+template <typename Char> AutoTypeResult Utf16TextReader<Char>::read(std::u32string_view &chunk) {
+    size_t count = 0;
+    while (count < buffer_.size() && pos_ < text_.size()) {
+        auto unit = static_cast<char32_t>(text_[pos_++]);
+        if (unit >= FIRST_HIGH_SURROGATE && unit < FIRST_LOW_SURROGATE && pos_ < text_.size()) {
+            auto low = static_cast<char32_t>(text_[pos_++]);
+            unit = FIRST_SUPPLEMENTARY_CODE_POINT +
+                   ((unit - FIRST_HIGH_SURROGATE) << SURROGATE_BITS) + (low - FIRST_LOW_SURROGATE);
+        }
+        buffer_.at(count++) = unit;
+    }
+    chunk = std::u32string_view(buffer_.data(), count);
+    return AutoTypeResult::Ok;
+}
+
+template class Utf16TextReader<char16_t>;
+template class Utf16TextReader<wchar_t>;
+
+AutoTypeResult WideTextReader::read(std::u32string_view &chunk) {
+    auto count = std::min(buffer_.size(), text_.size() - pos_);
+    for (size_t i = 0; i < count; i++) {
+        buffer_.at(i) = static_cast<char32_t>(text_[pos_ + i]);
+    }
+    pos_ += count;
+    chunk = std::u32string_view(buffer_.data(), count);
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult CallbackTextReader::read(std::u32string_view &chunk) {
+    auto count = reader_(buffer_.data(), buffer_.size());
+    if (count > buffer_.size()) {
+        chunk = {};
+        return fail(AutoTypeResult::BadArg, "Text reader returned more characters than requested");
+    }
+    chunk = std::u32string_view(buffer_.data(), count);
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult Utf8StreamTextReader::read(std::u32string_view &chunk) {
+    chunk = {};
+    if (invalid_byte_.has_value()) {
+        return fail(AutoTypeResult::BadArg,
+                    "Invalid UTF-8 sequence at byte " + std::to_string(invalid_byte_.value()));
+    }
+
+    if (stream_) {
+        auto *free_space = bytes_.data() + bytes_size_; // NOLINT(*-pointer-arithmetic)
+        stream_.read(free_space, static_cast<std::streamsize>(bytes_.size() - bytes_size_));
+        bytes_size_ += static_cast<size_t>(stream_.gcount());
+        if (stream_.bad()) {
+            return fail(AutoTypeResult::OsError, "Failed to read the text stream");
+        }
+    }
+    auto at_end = !stream_;
+
+    std::string_view text(bytes_.data(), bytes_size_);
+    if (!at_end) {
+        // the rest of the last sequence will come with the next read
+        text = text.substr(0, complete_utf8_size(text));
+    }
+    auto invalid_pos = find_invalid_utf8(text);
+    if (invalid_pos.has_value()) {
+        if (!invalid_pos.value()) {
+            return fail(AutoTypeResult::BadArg,
+                        "Invalid UTF-8 sequence at byte " + std::to_string(stream_pos_));
+        }
+        invalid_byte_ = stream_pos_ + invalid_pos.value();
+        text = text.substr(0, invalid_pos.value());
+    }
+
+    size_t pos = 0;
+    auto count = decode_utf8(text, pos, buffer_);
+    chunk = std::u32string_view(buffer_.data(), count);
+
+    // NOLINTNEXTLINE(*-pointer-arithmetic)
+    std::memmove(bytes_.data(), bytes_.data() + text.size(), bytes_size_ - text.size());
+    bytes_size_ -= text.size();
+    stream_pos_ += text.size();
+
+    return AutoTypeResult::Ok;
+}
+
+} // namespace keyboard_auto_type
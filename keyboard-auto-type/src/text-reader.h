@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "keyboard-auto-type.h"
+
+namespace keyboard_auto_type {
+
+constexpr size_t TEXT_READER_CHUNK_SIZE = 256;
+
+// Supplies text to AutoType in chunks, so that long strings in other encodings
+// are decoded while typing instead of being converted to UTF-32 first
+class TextReader {
+  private:
+    std::string error_;
+
+  protected:
+    AutoTypeResult fail(AutoTypeResult result, std::string message) {
+        error_ = std::move(message);
+        return result;
+    }
+
+  public:
+    TextReader() = default;
+    virtual ~TextReader() = default;
+    TextReader(const TextReader &) = delete;
+    TextReader &operator=(const TextReader &) = delete;
+    TextReader(TextReader &&) = delete;
+    TextReader &operator=(TextReader &&) = delete;
+
+    // Sets chunk to the next part of the text, up to TEXT_READER_CHUNK_SIZE characters,
+    // an empty chunk means the end of the text
+    // Errors are returned without throwing, so that the caller can release modifiers first
+    virtual AutoTypeResult read(std::u32string_view &chunk) = 0;
+    [[nodiscard]] const std::string &error() const { return error_; }
+};
+
+// Returns parts of the text without copying, it's already UTF-32
+class U32TextReader : public TextReader {
+  private:
+    std::u32string_view text_;
+
+  public:
+    explicit U32TextReader(std::u32string_view text) : text_(text) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override {
+        chunk = text_.substr(0, TEXT_READER_CHUNK_SIZE);
+        text_.remove_prefix(chunk.size());
+        return AutoTypeResult::Ok;
+    }
+};
+
+// Returns the index of the first code unit of the first invalid sequence,
+// or nullopt if the text is valid
+std::optional<size_t> find_invalid_utf8(std::string_view text);
+std::optional<size_t> find_invalid_utf16(std::u16string_view text);
+std::optional<size_t> find_invalid_utf16(std::wstring_view text);
+
+// Decodes UTF-8 validated with find_invalid_utf8
+class Utf8TextReader : public TextReader {
+  private:
+    std::string_view text_;
+    size_t pos_ = 0;
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> buffer_{};
+
+  public:
+    explicit Utf8TextReader(std::string_view text) : text_(text) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override;
+};
+
+// Decodes UTF-16 validated with find_invalid_utf16, Char is char16_t or 16-bit wchar_t
+template <typename Char> class Utf16TextReader : public TextReader {
+  private:
+    std::basic_string_view<Char> text_;
+    size_t pos_ = 0;
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> buffer_{};
+
+  public:
+    explicit Utf16TextReader(std::basic_string_view<Char> text) : text_(text) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override;
+};
+
+// Copies 32-bit wchar_t text to UTF-32 chunks
+class WideTextReader : public TextReader {
+  private:
+    std::wstring_view text_;
+    size_t pos_ = 0;
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> buffer_{};
+
+  public:
+    explicit WideTextReader(std::wstring_view text) : text_(text) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override;
+};
+
+// Pulls chunks from a user callback
+class CallbackTextReader : public TextReader {
+  private:
+    const TextChunkReader &reader_;
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> buffer_{};
+
+  public:
+    explicit CallbackTextReader(const TextChunkReader &reader) : reader_(reader) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override;
+};
+
+// Decodes UTF-8 read from a stream, the text can't be validated in advance,
+// so invalid sequences are reported when they're reached, with the text before them typed
+class Utf8StreamTextReader : public TextReader {
+  private:
+    std::istream &stream_;
+    // bytes of a sequence split between two reads are kept at the beginning of the buffer
+    std::array<char, TEXT_READER_CHUNK_SIZE> bytes_{};
+    size_t bytes_size_ = 0;
+    // position of bytes_ in the stream, for error messages
+    uint64_t stream_pos_ = 0;
+    // found after a valid part of the text, reported after the valid part is typed
+    std::optional<uint64_t> invalid_byte_;
+    std::array<char32_t, TEXT_READER_CHUNK_SIZE> buffer_{};
+
+  public:
+    explicit Utf8StreamTextReader(std::istream &stream) : stream_(stream) {}
+
+    AutoTypeResult read(std::u32string_view &chunk) override;
+};
+
+} // namespace keyboard_auto_type
@@ -13,7 +13,7 @@ AutoTypeResult throw_or_return(AutoTypeResult result, [[maybe_unused]] const std
     case AutoTypeResult::BadArg:
         throw std::invalid_argument(message);
     default:
-        throw std::runtime_error(message);
+        throw AutoTypeError(result, message);
     }
 #else
     return result;
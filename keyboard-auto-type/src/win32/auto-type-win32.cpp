@@ -2,11 +2,14 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <functional>
+#include <thread>
 #include <vector>
 
 #include "key-map.h"
 #include "keyboard-auto-type.h"
+#include "text-pipeline.h"
 #include "utils.h"
 #include "winapi-tools.h"
 
@@ -162,6 +165,37 @@ AutoTypeResult AutoType::key_move(Direction direction, char32_t character,
     return AutoTypeResult::Ok;
 }
 
+uint64_t AutoType::keyboard_layout_generation() {
+    return reinterpret_cast<uintptr_t>(impl_->active_layout());
+}
+
+uint32_t AutoType::native_key(os_key_code_t /*unused*/) { return 0; }
+
+// VkKeyScanEx doesn't depend on the state of the calling thread
+std::function<bool(std::u32string_view, PackedKeyCode *)> AutoType::background_key_resolver() {
+    return [layout = AutoTypeImpl::active_layout()](std::u32string_view text,
+                                                    PackedKeyCode *key_codes) {
+        for (size_t i = 0; i < text.length(); i++) {
+            // NOLINTNEXTLINE(*-pointer-arithmetic)
+            key_codes[i] = PackedKeyCode(AutoTypeImpl::char_to_key_code(layout, text[i]));
+        }
+        return true;
+    };
+}
+
+// keys are looked up in the active layout on each call, nothing is initialized lazily
+AutoTypeResult AutoType::prepare_backend(const ActiveWindowArgs & /*unused*/) {
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult AutoType::map_missing_keys(const PackedKeyCode * /*unused*/, size_t /*unused*/) {
+    return AutoTypeResult::Ok;
+}
+
+AutoTypeResult AutoType::key_move(const TypingProgramEvent &event) {
+    return key_move(event.direction, event.character, event.code, event.modifier);
+}
+
 Modifier AutoType::get_pressed_modifiers() {
     static constexpr std::array FLAGS_MODIFIERS{
         std::make_pair(VK_LWIN, Modifier::LeftWin),
@@ -183,6 +217,10 @@ Modifier AutoType::get_pressed_modifiers() {
     return pressed_modifiers;
 }
 
+void AutoType::wait_for_modifiers_change(std::chrono::milliseconds timeout) {
+    std::this_thread::sleep_for(timeout);
+}
+
 Modifier AutoType::shortcut_modifier() { return Modifier::Control; }
 
 std::optional<os_key_code_t> AutoType::os_key_code(KeyCode code) {
@@ -200,15 +238,18 @@ std::optional<KeyCodeWithModifiers> AutoType::os_key_code_for_char(char32_t char
     return impl_->char_to_key_code(impl_->active_layout(), character);
 }
 
-std::vector<std::optional<KeyCodeWithModifiers>>
-AutoType::os_key_codes_for_chars(std::u32string_view text) {
+AutoTypeResult AutoType::os_key_codes_for_chars(std::u32string_view text,
+                                                PackedKeyCode *key_codes, size_t key_codes_size) {
+    if (key_codes_size < text.length()) {
+        return throw_or_return(AutoTypeResult::BadArg, "Key codes buffer is too small");
+    }
     auto layout = impl_->active_layout();
-    std::vector<std::optional<KeyCodeWithModifiers>> result(text.length());
     auto length = text.length();
     for (size_t i = 0; i < length; i++) {
-        result[i] = impl_->char_to_key_code(layout, text[i]);
+        // NOLINTNEXTLINE(*-pointer-arithmetic)
+        key_codes[i] = PackedKeyCode(impl_->char_to_key_code(layout, text[i]));
     }
-    return result;
+    return AutoTypeResult::Ok;
 }
 
 pid_t AutoType::active_pid() {
@@ -293,4 +334,12 @@ bool AutoType::show_window(const AppWindow &window) {
 
 AutoTypeTextTransaction AutoType::begin_batch_text_entry() { return AutoTypeTextTransaction(); }
 
+AutoTypeResult AutoType::flush() { return AutoTypeResult::Ok; }
+
+void AutoType::set_batch_flush_chunk_size(size_t /*unused*/) {}
+
+void AutoType::set_key_mapping_idle_time(std::chrono::milliseconds /*unused*/) {}
+
+void AutoType::set_use_scratch_keyboard_group(bool /*unused*/) {}
+
 } // namespace keyboard_auto_type
@@ -45,6 +45,18 @@ const FILE_PATH = path.join(__dirname, '../keyboard-auto-type/src/linux/x11-keys
         console.log(`CodePoints: 0x${minCodePoint.toString(16).padStart(4, '0')} .. 0x${maxCodePoint.toString(16)}`);
         console.log(`KeySyms: 0x${minKeySym.toString(16).padStart(4, '0')} .. 0x${maxKeySym.toString(16)}`);
 
+        // the maps are expanded to a page table at compile time, one page per 256 code points
+        const pages = new Set([...mapped.keys(), ...special.keys()].map(codePoint => codePoint >> 8));
+        if (pages.size >= 0xff) {
+            throw new Error(`Too many pages: ${pages.size}`);
+        }
+        for (const codePoint of special.keys()) {
+            if (codePoint >= 0xffff) {
+                throw new Error(`Too high special CodePoint: ${codePoint}`);
+            }
+        }
+        console.log(`Pages: ${pages.size}, table size: ${(pages.size + 1) * 256 * 2 + 256} bytes`);
+
         const template = fs.readFileSync(FILE_PATH, 'utf8');
         const code = generateCode(template, mapped, special);
         fs.writeFileSync(FILE_PATH, code);
@@ -125,6 +137,7 @@ function printSymbolMap({ plus1M, mapped }) {
 }
 
 function generateCode(template, mapped, special) {
+    let found = false;
     const charMap16Code = [...mapped]
         .sort(([cp1], [cp2]) => cp1 - cp2)
         .map(([codePoint, keySym]) => `0x${wordHex(codePoint)}'${wordHex(keySym)}U`)
@@ -141,6 +154,7 @@ function generateCode(template, mapped, special) {
         .sort(([cp1], [cp2]) => cp1 - cp2)
         .map(([codePoint, keySym]) => `0x${dwordHex(codePoint)}'${dwordHex(keySym)}U`)
         .join(', ');
+    found = false;
     result = result.replace(/CHAR_MAP_32\s*\{[\s\S]*?\}/, () => {
         found = true;
         return `CHAR_MAP_32{\n    ${charMap32Code}\n}`;
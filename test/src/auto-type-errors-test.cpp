@@ -1,5 +1,9 @@
+#include <future>
+#include <memory>
+#include <sstream>
 #include <string>
 
+#include "async-auto-type.h"
 #include "gtest/gtest.h"
 #include "keyboard-auto-type.h"
 
@@ -41,6 +45,27 @@ TEST_F(AutoTypeErrorsTest, text_null_char) {
     ASSERT_THROWS_OR_RETURNS(typer.text(str), std::invalid_argument, kbd::AutoTypeResult::BadArg);
 }
 
+TEST_F(AutoTypeErrorsTest, text_bad_utf8) {
+    kbd::AutoType typer;
+    ASSERT_THROWS_OR_RETURNS(typer.text(std::string_view("ab\xC3(")), std::invalid_argument,
+                             kbd::AutoTypeResult::BadArg);
+    ASSERT_EQ(0, typer.stats().chars_sent);
+}
+
+TEST_F(AutoTypeErrorsTest, text_bad_utf16) {
+    kbd::AutoType typer;
+    std::u16string str{u'a', static_cast<char16_t>(0xD801)};
+    ASSERT_THROWS_OR_RETURNS(typer.text(str), std::invalid_argument, kbd::AutoTypeResult::BadArg);
+}
+
+TEST_F(AutoTypeErrorsTest, text_stream_bad_utf8) {
+    kbd::AutoType typer;
+    std::istringstream stream("\xC3(");
+    ASSERT_THROWS_OR_RETURNS(typer.text(stream), std::invalid_argument,
+                             kbd::AutoTypeResult::BadArg);
+    ASSERT_EQ(0, typer.stats().chars_sent);
+}
+
 TEST_F(AutoTypeErrorsTest, text_modifier_not_released) {
     kbd::AutoType typer;
     typer.set_auto_unpress_modifiers(false);
@@ -50,6 +75,76 @@ TEST_F(AutoTypeErrorsTest, text_modifier_not_released) {
                              kbd::AutoTypeResult::ModifierNotReleased);
 }
 
+TEST_F(AutoTypeErrorsTest, text_cancelled) {
+    kbd::AutoType typer;
+    kbd::CancellationToken token;
+    typer.set_cancellation_token(token);
+    token.cancel();
+    ASSERT_THROWS_OR_RETURNS(typer.text(U"abc"), std::runtime_error,
+                             kbd::AutoTypeResult::Cancelled);
+    ASSERT_EQ(0, typer.stats().chars_sent);
+}
+
+TEST_F(AutoTypeErrorsTest, async_cancel) {
+    kbd::AsyncAutoType typer;
+
+    std::promise<void> job_started;
+    std::promise<void> cancel_called;
+    std::promise<kbd::AutoTypeResult> running_result;
+    std::promise<kbd::AutoTypeResult> queued_result;
+    typer.submit(
+        [&](kbd::AutoType &sync_typer) {
+            job_started.set_value();
+            cancel_called.get_future().wait();
+            return sync_typer.text(U"abc");
+        },
+        [&](kbd::AutoTypeResult result, std::exception_ptr) { running_result.set_value(result); });
+    typer.submit([](kbd::AutoType &sync_typer) { return sync_typer.text(U"abc"); },
+                 [&](kbd::AutoTypeResult result, std::exception_ptr) {
+                     queued_result.set_value(result);
+                 });
+
+    job_started.get_future().wait();
+    typer.cancel();
+    cancel_called.set_value();
+
+    ASSERT_EQ(kbd::AutoTypeResult::Cancelled, running_result.get_future().get());
+    ASSERT_EQ(kbd::AutoTypeResult::Cancelled, queued_result.get_future().get());
+}
+
+TEST_F(AutoTypeErrorsTest, async_destroy_cancels_jobs) {
+    auto typer = std::make_unique<kbd::AsyncAutoType>();
+
+    std::promise<void> job_started;
+    std::promise<kbd::AutoTypeResult> running_result;
+    std::promise<kbd::AutoTypeResult> queued_result;
+    auto queued_job_started = false;
+    typer->submit(
+        [&](kbd::AutoType &sync_typer) {
+            job_started.set_value();
+            // runs until cancelled
+            auto result = kbd::AutoTypeResult::Ok;
+            while (result == kbd::AutoTypeResult::Ok) {
+                result = sync_typer.key_press(kbd::KeyCode::Shift);
+            }
+            return result;
+        },
+        [&](kbd::AutoTypeResult result, std::exception_ptr) { running_result.set_value(result); });
+    typer->submit(
+        [&](kbd::AutoType &sync_typer) {
+            queued_job_started = true;
+            return sync_typer.text(U"abc");
+        },
+        [&](kbd::AutoTypeResult result, std::exception_ptr) { queued_result.set_value(result); });
+
+    job_started.get_future().wait();
+    typer.reset();
+
+    ASSERT_EQ(kbd::AutoTypeResult::Cancelled, running_result.get_future().get());
+    ASSERT_EQ(kbd::AutoTypeResult::Cancelled, queued_result.get_future().get());
+    ASSERT_FALSE(queued_job_started);
+}
+
 TEST_F(AutoTypeErrorsTest, key_move_bad_key) {
     kbd::AutoType typer;
     ASSERT_THROWS_OR_RETURNS(typer.key_move(kbd::Direction::Down, kbd::KeyCode::KeyCodeCount),
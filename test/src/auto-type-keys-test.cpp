@@ -1,11 +1,16 @@
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <sstream>
 #include <string>
 
+#include "async-auto-type.h"
 #include "gtest/gtest.h"
 #include "keyboard-auto-type.h"
+#include "utils/allocation-counter.h"
 #include "utils/test-util.h"
 
 namespace kbd = keyboard_auto_type;
@@ -219,6 +224,149 @@ TEST_F(AutoTypeKeysTest, text_wstring) {
     typer.text(L"AbCßµḀ");
 }
 
+TEST_F(AutoTypeKeysTest, text_utf8) {
+    expected_text = U"AbCßµḀ😀";
+
+    kbd::AutoType typer;
+    typer.text(std::string_view("AbCßµḀ😀"));
+}
+
+TEST_F(AutoTypeKeysTest, text_utf16) {
+    expected_text = U"AbCßµḀ😀";
+
+    kbd::AutoType typer;
+    typer.text(u"AbCßµḀ😀");
+}
+
+TEST_F(AutoTypeKeysTest, text_stream) {
+    expected_text = U"AbCßµḀ😀";
+
+    std::istringstream stream("AbCßµḀ😀");
+    kbd::AutoType typer;
+    typer.text(stream);
+}
+
+TEST_F(AutoTypeKeysTest, text_pipeline) {
+    for (auto i = 0; i < 20; i++) {
+        expected_text += U"Hello, World! ";
+    }
+
+    kbd::AutoType typer;
+    typer.text(expected_text);
+    ASSERT_EQ(expected_text.length(), typer.stats().chars_sent);
+}
+
+TEST_F(AutoTypeKeysTest, text_pipeline_no_allocations) {
+    std::u32string text;
+    for (auto i = 0; i < 20; i++) {
+        text += U"Hello, World! ";
+    }
+    expected_text = text + text;
+
+    kbd::AutoType typer;
+    typer.text(text);
+
+    // the pipeline thread and buffers of the first text are reused
+    AllocationCounter allocations;
+    typer.text(text);
+    ASSERT_EQ(0, allocations.count());
+    ASSERT_EQ(text.length(), typer.stats().chars_sent);
+}
+
+TEST_F(AutoTypeKeysTest, text_chunk_reader) {
+    for (auto i = 0; i < 20; i++) {
+        expected_text += U"Hello, World! ";
+    }
+
+    std::u32string_view rest = expected_text;
+    kbd::AutoType typer;
+    typer.text([&](char32_t *buffer, size_t size) {
+        auto count = rest.copy(buffer, std::min<size_t>(size, 5));
+        rest.remove_prefix(count);
+        return count;
+    });
+}
+
+TEST_F(AutoTypeKeysTest, run_typing_program) {
+    expected_text = U"AbC!ßAbC!ß";
+
+    kbd::AutoType typer;
+    kbd::TypingProgram program;
+    typer.compile(U"AbC!ß", program);
+    ASSERT_EQ(5, program.length());
+    typer.run(program);
+    typer.run(program);
+}
+
+TEST_F(AutoTypeKeysTest, text_no_allocations) {
+    expected_text = U"Hello, World!Hello, World!";
+
+    kbd::AutoType typer;
+    typer.text(U"Hello, World!");
+
+    AllocationCounter allocations;
+    typer.text(U"Hello, World!");
+    ASSERT_EQ(0, allocations.count());
+}
+
+TEST_F(AutoTypeKeysTest, os_key_codes_for_chars_packed) {
+    std::u32string text = U"aB1 \n";
+    std::array<kbd::PackedKeyCode, 5> key_codes{};
+
+    kbd::AutoType typer;
+    auto expected = typer.os_key_codes_for_chars(text);
+
+    AllocationCounter allocations;
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, kbd::os_key_codes_for_chars(typer, text, key_codes));
+    ASSERT_EQ(0, allocations.count());
+
+    for (size_t i = 0; i < text.length(); i++) {
+        ASSERT_TRUE(expected[i].has_value());
+        ASSERT_TRUE(key_codes[i].has_value());
+        ASSERT_EQ(expected[i]->code, key_codes[i].code());
+        ASSERT_EQ(expected[i]->modifier, key_codes[i].modifier());
+    }
+}
+
+TEST_F(AutoTypeKeysTest, warm_up) {
+    expected_text = U"Hello";
+
+    kbd::AutoType typer;
+    ASSERT_FALSE(typer.is_hot());
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, typer.warm_up());
+    ASSERT_TRUE(typer.is_hot());
+    typer.text(expected_text);
+}
+
+TEST_F(AutoTypeKeysTest, async_warm_up) {
+    expected_text = U"Hello";
+
+    kbd::AsyncAutoType typer;
+    auto warm_up_result = typer.warm_up();
+    auto text_result = typer.text(U"Hello");
+
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, warm_up_result.get());
+    ASSERT_TRUE(typer.is_hot());
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, text_result.get());
+}
+
+TEST_F(AutoTypeKeysTest, async_text_and_key_press) {
+    expected_text = U"Hello1!";
+
+    kbd::AsyncAutoType typer;
+    auto text_result = typer.text(U"Hello");
+    auto key_result = typer.key_press(kbd::KeyCode::D1);
+    std::promise<kbd::AutoTypeResult> callback_result;
+    typer.submit([](kbd::AutoType &sync_typer) { return sync_typer.text(U"!"); },
+                 [&](kbd::AutoTypeResult result, std::exception_ptr) {
+                     callback_result.set_value(result);
+                 });
+
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, text_result.get());
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, key_result.get());
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, callback_result.get_future().get());
+}
+
 TEST_F(AutoTypeKeysTest, text_whitespace) {
     expected_text = U" \t";
     expected_events = {
@@ -329,6 +477,80 @@ TEST_F(AutoTypeKeysTest, text_unicode_supplementary_ideographic) {
     typer.text(expected_text);
 }
 
+TEST_F(AutoTypeKeysTest, text_stats_state_changes) {
+    expected_text = U"Hello";
+    kbd::AutoType typer;
+    typer.text(expected_text);
+    // all characters are in the active group
+    ASSERT_EQ(0, typer.stats().state_changes);
+}
+
+#if !__APPLE__ && !defined(_WIN32)
+// options of the X11 backend, other platforms ignore them
+
+TEST_F(AutoTypeKeysTest, text_batch_flush_chunk_size) {
+    expected_text = U"Hello, World!Hello, World!";
+
+    kbd::AutoType typer;
+    typer.set_batch_flush_chunk_size(4);
+    typer.text(U"Hello, World!");
+    auto round_trips_saved = typer.stats().round_trips_saved;
+    // at least key down and up for each character, synced once
+    ASSERT_GE(round_trips_saved, 13 * 2 - 1);
+
+    typer.set_batch_flush_chunk_size(0);
+    typer.text(U"Hello, World!");
+    // flushing the queue more often doesn't add round trips
+    ASSERT_EQ(round_trips_saved, typer.stats().round_trips_saved);
+}
+
+TEST_F(AutoTypeKeysTest, text_key_mapping_idle_time) {
+    expected_text = U"😀😀😀";
+
+    kbd::AutoType typer;
+    typer.set_key_mapping_idle_time(std::chrono::seconds(10));
+    typer.text(U"😀");
+    ASSERT_GT(typer.stats().key_mapping_wait_time.count(), 0);
+
+    // the mapping is kept after the first call
+    typer.text(U"😀");
+    ASSERT_EQ(0, typer.stats().key_mapping_wait_time.count());
+
+    // now it's removed after typing, this waits for the app as well
+    typer.set_key_mapping_idle_time(std::chrono::milliseconds(0));
+    typer.text(U"😀");
+    ASSERT_GT(typer.stats().key_mapping_wait_time.count(), 0);
+}
+
+TEST_F(AutoTypeKeysTest, text_scratch_keyboard_group) {
+    expected_text = U"a😀b🙂c";
+
+    kbd::AutoType typer;
+    typer.set_use_scratch_keyboard_group(true);
+    typer.text(expected_text);
+
+    auto stats = typer.stats();
+    ASSERT_EQ(expected_text.length(), stats.chars_sent);
+    ASSERT_GT(stats.key_mapping_wait_time.count(), 0);
+    // typing mixes the active and the scratch group, the group is locked and restored
+    ASSERT_GE(stats.state_changes, 2);
+}
+
+TEST_F(AutoTypeKeysTest, text_more_missing_characters_than_key_codes) {
+    // there are at most 248 key codes, so some of them are mapped again while typing
+    for (char32_t ch = U'\u4E00'; ch < U'\u4E00' + 260; ch++) {
+        expected_text += ch;
+    }
+
+    kbd::AutoType typer;
+    typer.text(expected_text);
+
+    ASSERT_EQ(expected_text.length(), typer.stats().chars_sent);
+    ASSERT_GT(typer.stats().key_mapping_wait_time.count(), 0);
+}
+
+#endif
+
 TEST_F(AutoTypeKeysTest, text_unpress_modifiers) {
     expected_text = U"a";
     kbd::AutoType typer;
@@ -336,6 +558,32 @@ TEST_F(AutoTypeKeysTest, text_unpress_modifiers) {
     typer.text(U"a");
 }
 
+TEST_F(AutoTypeKeysTest, text_two_instances) {
+    expected_text = U"abcdef";
+    kbd::AutoType first;
+    kbd::AutoType second;
+    first.text(U"ab");
+    second.text(U"cd");
+    first.text(U"ef");
+}
+
+TEST_F(AutoTypeKeysTest, text_two_instances_modifier_released_by_other) {
+    expected_text = U"a";
+    kbd::AutoType holder;
+    holder.key_move(kbd::Direction::Down, kbd::Modifier::Shift);
+
+    kbd::AutoType typer;
+    typer.set_auto_unpress_modifiers(false);
+    auto typed = std::async(std::launch::async, [&] { return typer.text(U"a"); });
+    wait_millis(500);
+
+    // the instance waiting for the modifier doesn't block others sharing the connection
+    auto started = std::chrono::steady_clock::now();
+    holder.key_move(kbd::Direction::Up, kbd::Modifier::Shift);
+    ASSERT_LT(std::chrono::steady_clock::now() - started, std::chrono::seconds(1));
+    ASSERT_EQ(kbd::AutoTypeResult::Ok, typed.get());
+}
+
 TEST_F(AutoTypeKeysTest, key_press_key_code) {
     expected_text = U"0b";
     kbd::AutoType typer;
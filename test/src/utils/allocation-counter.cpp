@@ -0,0 +1,51 @@
+#include "allocation-counter.h"
+
+#include <cstdlib>
+#include <new>
+
+namespace keyboard_auto_type_test {
+
+thread_local bool counting_allocations = false;
+thread_local size_t allocations_count = 0;
+
+AllocationCounter::AllocationCounter() {
+    allocations_count = 0;
+    counting_allocations = true;
+}
+
+AllocationCounter::~AllocationCounter() { counting_allocations = false; }
+
+size_t AllocationCounter::count() const { return allocations_count; }
+
+static void *counted_alloc(size_t size) {
+    if (counting_allocations) {
+        allocations_count++;
+    }
+    auto *ptr = std::malloc(size == 0 ? 1 : size);
+    if (!ptr) {
+        std::abort();
+    }
+    return ptr;
+}
+
+} // namespace keyboard_auto_type_test
+
+void *operator new(size_t size) { return keyboard_auto_type_test::counted_alloc(size); }
+
+void *operator new[](size_t size) { return keyboard_auto_type_test::counted_alloc(size); }
+
+void *operator new(size_t size, const std::nothrow_t & /*unused*/) noexcept {
+    return keyboard_auto_type_test::counted_alloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t & /*unused*/) noexcept {
+    return keyboard_auto_type_test::counted_alloc(size);
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t /*unused*/) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr, size_t /*unused*/) noexcept { std::free(ptr); }
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+
+namespace keyboard_auto_type_test {
+
+// Counts heap allocations made with operator new by the current thread while it exists
+class AllocationCounter {
+  public:
+    AllocationCounter();
+    ~AllocationCounter();
+    AllocationCounter(const AllocationCounter &) = delete;
+    AllocationCounter &operator=(const AllocationCounter &) = delete;
+    AllocationCounter(AllocationCounter &&) = delete;
+    AllocationCounter &operator=(AllocationCounter &&) = delete;
+
+    [[nodiscard]] size_t count() const;
+};
+
+} // namespace keyboard_auto_type_test
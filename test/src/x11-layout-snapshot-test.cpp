@@ -0,0 +1,255 @@
+// before Xlib, which defines None as a macro
+#include "gtest/gtest.h"
+
+#include <X11/XKBlib.h>
+#include <X11/extensions/XKBstr.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "linux/x11-layout-snapshot.h"
+
+namespace kbd = keyboard_auto_type;
+
+namespace keyboard_auto_type_test {
+
+class X11LayoutSnapshotTest : public testing::Test {
+  protected:
+    static constexpr int MIN_KEY_CODE = 8;
+    static constexpr int MAX_KEY_CODE = 20;
+    static constexpr int EMPTY_KEY_CODE = 15;
+    // keys from this one have the second group
+    static constexpr int FIRST_TWO_GROUP_KEY_CODE = 18;
+    static constexpr uint64_t KEYMAP_ID = 0x1234;
+
+    std::filesystem::path cache_dir;
+    std::optional<std::string> prev_cache_home;
+    kbd::X11ReservedKeys reserved_keys;
+
+    void SetUp() override {
+        // NOLINTNEXTLINE(concurrency-mt-unsafe)
+        if (const auto *cache_home = std::getenv("XDG_CACHE_HOME")) {
+            prev_cache_home = cache_home;
+        }
+        auto dir = (std::filesystem::temp_directory_path() / "kbd-auto-type-XXXXXX").string();
+        ASSERT_TRUE(mkdtemp(dir.data()));
+        cache_dir = dir;
+        setenv("XDG_CACHE_HOME", cache_dir.c_str(), 1); // NOLINT(concurrency-mt-unsafe)
+    }
+
+    void TearDown() override {
+        // other tests must not write their snapshots to the removed directory
+        // NOLINTBEGIN(concurrency-mt-unsafe)
+        if (prev_cache_home) {
+            setenv("XDG_CACHE_HOME", prev_cache_home->c_str(), 1);
+        } else {
+            unsetenv("XDG_CACHE_HOME");
+        }
+        // NOLINTEND(concurrency-mt-unsafe)
+        if (!cache_dir.empty()) {
+            std::filesystem::remove_all(cache_dir);
+        }
+    }
+
+    // Keymap without a display: lowercase and uppercase letters, one key without key syms,
+    // the last keys have the second group
+    static kbd::XkbDescHandle make_keymap(KeySym first_key_sym = 'a') {
+        auto *xkb = XkbAllocKeyboard();
+        xkb->min_key_code = MIN_KEY_CODE;
+        xkb->max_key_code = MAX_KEY_CODE;
+        XkbAllocClientMap(xkb, XkbKeyTypesMask | XkbKeySymsMask, XkbNumRequiredTypes);
+        XkbInitCanonicalKeyTypes(xkb, XkbAllRequiredTypes, XkbNoModifier);
+        for (auto key_code = MIN_KEY_CODE; key_code <= MAX_KEY_CODE; key_code++) {
+            if (key_code == EMPTY_KEY_CODE) {
+                continue;
+            }
+            auto groups = key_code >= FIRST_TWO_GROUP_KEY_CODE ? 2 : 1;
+            auto *key_syms = XkbResizeKeySyms(xkb, key_code, 2 * groups);
+            auto &key_sym_map = xkb->map->key_sym_map[key_code];
+            key_sym_map.group_info = XkbSetNumGroups(0, groups);
+            key_sym_map.kt_index[0] = XkbTwoLevelIndex;
+            key_sym_map.kt_index[1] = XkbTwoLevelIndex;
+            key_sym_map.width = 2;
+            auto offset = static_cast<KeySym>(key_code - MIN_KEY_CODE);
+            key_syms[0] = first_key_sym + offset;
+            key_syms[1] = first_key_sym + offset + 0x100;
+            if (groups == 2) {
+                key_syms[2] = 0x1000 + offset;
+                key_syms[3] = 0x2000 + offset;
+            }
+        }
+        return kbd::XkbDescHandle(xkb);
+    }
+
+    // Layout of make_keymap, as it's saved for a keymap with this id
+    std::shared_ptr<kbd::X11KeyboardLayout> build_layout() {
+        auto layout = kbd::x11_build_keyboard_layout(make_keymap(), 0, reserved_keys);
+        layout->keymap_id = KEYMAP_ID;
+        return layout;
+    }
+
+    // Maps a key sym to the empty key, the same way as it's done to type missing characters
+    static void map_empty_key(XkbDescPtr xkb) {
+        auto *key_syms = XkbResizeKeySyms(xkb, EMPTY_KEY_CODE, 1);
+        auto &key_sym_map = xkb->map->key_sym_map[EMPTY_KEY_CODE];
+        key_sym_map.group_info = XkbSetNumGroups(0, 1);
+        key_sym_map.kt_index[0] = XkbOneLevelIndex;
+        key_sym_map.width = 1;
+        key_syms[0] = 0x3000;
+    }
+
+    std::vector<uint8_t> save_snapshot(const kbd::X11KeyboardLayout &layout) {
+        kbd::x11_save_layout_snapshot(layout);
+        std::vector<uint8_t> data;
+        for (const auto &entry : std::filesystem::directory_iterator(cache_dir /
+                                                                     "keyboard-auto-type")) {
+            std::ifstream file(entry.path(), std::ios::binary);
+            data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        return data;
+    }
+
+    // The parsed layout keeps the data, like the mapped file
+    static std::shared_ptr<const uint8_t> share(const std::vector<uint8_t> &data) {
+        auto shared = std::make_shared<std::vector<uint8_t>>(data);
+        return {shared, shared->data()};
+    }
+
+    size_t snapshot_files_count() {
+        auto files = std::filesystem::directory_iterator(cache_dir / "keyboard-auto-type");
+        return std::distance(begin(files), end(files));
+    }
+};
+
+TEST_F(X11LayoutSnapshotTest, load_saved_snapshot) {
+    auto layout = build_layout();
+    kbd::x11_save_layout_snapshot(*layout);
+
+    auto loaded = kbd::x11_load_layout_snapshot(KEYMAP_ID, 0);
+    ASSERT_TRUE(loaded);
+    ASSERT_TRUE(loaded->snapshot);
+    ASSERT_EQ(layout->keymap_hash, loaded->keymap_hash);
+    ASSERT_EQ(layout->keys, loaded->keys);
+    ASSERT_EQ(layout->inactive_group_keys.keys(), loaded->inactive_group_keys.keys());
+    ASSERT_EQ(layout->empty_key_codes, loaded->empty_key_codes);
+    ASSERT_FALSE(kbd::x11_load_layout_snapshot(KEYMAP_ID, 1));
+    ASSERT_FALSE(kbd::x11_load_layout_snapshot(KEYMAP_ID + 1, 0));
+}
+
+TEST_F(X11LayoutSnapshotTest, parse_snapshot) {
+    auto layout = build_layout();
+    auto data = save_snapshot(*layout);
+    ASSERT_FALSE(data.empty());
+
+    auto shared_data = share(data);
+    auto parsed = kbd::x11_parse_layout_snapshot(shared_data, data.size(), KEYMAP_ID, 0);
+    ASSERT_TRUE(parsed);
+    ASSERT_EQ(layout->keys, parsed->keys);
+
+    // keys are found in the data, the tables are not copied
+    const auto *key = parsed->find('a');
+    ASSERT_TRUE(key);
+    ASSERT_EQ(MIN_KEY_CODE, key->key_code);
+    const auto *key_data = reinterpret_cast<const uint8_t *>(key);
+    ASSERT_GE(key_data, shared_data.get());
+    ASSERT_LT(key_data, shared_data.get() + data.size());
+}
+
+TEST_F(X11LayoutSnapshotTest, parse_snapshot_truncated) {
+    auto data = save_snapshot(*build_layout());
+
+    for (auto size : {data.size() - 1, size_t{16}, size_t{0}}) {
+        ASSERT_FALSE(kbd::x11_parse_layout_snapshot(share(data), size, KEYMAP_ID, 0))
+            << "Size " << size;
+    }
+}
+
+TEST_F(X11LayoutSnapshotTest, parse_snapshot_wrong_version) {
+    auto data = save_snapshot(*build_layout());
+
+    // the version follows the magic number
+    uint32_t version = 0;
+    std::memcpy(&version, data.data() + sizeof(uint32_t), sizeof(version));
+    version++;
+    std::memcpy(data.data() + sizeof(uint32_t), &version, sizeof(version));
+
+    ASSERT_FALSE(kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID, 0));
+}
+
+TEST_F(X11LayoutSnapshotTest, parse_snapshot_other_keymap) {
+    auto data = save_snapshot(*build_layout());
+
+    ASSERT_FALSE(kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID + 1, 0));
+    ASSERT_FALSE(kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID, 1));
+}
+
+TEST_F(X11LayoutSnapshotTest, match_snapshot_keys) {
+    auto data = save_snapshot(*build_layout());
+    auto parsed = kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID, 0);
+    ASSERT_TRUE(parsed);
+    auto &snapshot = *parsed->snapshot;
+    ASSERT_FALSE(snapshot.is_checked(MIN_KEY_CODE));
+
+    auto keymap = make_keymap();
+    ASSERT_TRUE(kbd::x11_match_snapshot_keys(keymap.get(), snapshot, MIN_KEY_CODE, MIN_KEY_CODE,
+                                             reserved_keys));
+    ASSERT_TRUE(snapshot.is_checked(MIN_KEY_CODE));
+    ASSERT_FALSE(snapshot.is_checked(MIN_KEY_CODE + 1));
+
+    ASSERT_TRUE(kbd::x11_match_snapshot_keys(keymap.get(), snapshot, MIN_KEY_CODE, MAX_KEY_CODE,
+                                             reserved_keys));
+    for (auto key_code = MIN_KEY_CODE; key_code <= MAX_KEY_CODE; key_code++) {
+        ASSERT_TRUE(snapshot.is_checked(key_code)) << "Key code " << key_code;
+    }
+}
+
+TEST_F(X11LayoutSnapshotTest, match_snapshot_keys_changed) {
+    auto data = save_snapshot(*build_layout());
+    auto parsed = kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID, 0);
+    ASSERT_TRUE(parsed);
+
+    // same names, but the keys have been remapped
+    auto other_keymap = make_keymap('A');
+    ASSERT_FALSE(kbd::x11_match_snapshot_keys(other_keymap.get(), *parsed->snapshot,
+                                              MIN_KEY_CODE, MIN_KEY_CODE, reserved_keys));
+    ASSERT_FALSE(parsed->snapshot->is_checked(MIN_KEY_CODE));
+
+    // the empty key is not empty anymore
+    auto keymap = make_keymap();
+    map_empty_key(keymap.get());
+    ASSERT_FALSE(kbd::x11_match_snapshot_keys(keymap.get(), *parsed->snapshot, EMPTY_KEY_CODE,
+                                              EMPTY_KEY_CODE, reserved_keys));
+}
+
+TEST_F(X11LayoutSnapshotTest, match_snapshot_keys_reserved) {
+    auto data = save_snapshot(*build_layout());
+    auto parsed = kbd::x11_parse_layout_snapshot(share(data), data.size(), KEYMAP_ID, 0);
+    ASSERT_TRUE(parsed);
+
+    // the empty key is mapped by us, it's not a change of the keymap
+    auto keymap = make_keymap();
+    map_empty_key(keymap.get());
+    ASSERT_TRUE(reserved_keys.try_reserve_key_code(EMPTY_KEY_CODE));
+    ASSERT_TRUE(kbd::x11_match_snapshot_keys(keymap.get(), *parsed->snapshot, MIN_KEY_CODE,
+                                             MAX_KEY_CODE, reserved_keys));
+}
+
+TEST_F(X11LayoutSnapshotTest, prune_old_snapshots) {
+    auto layout = build_layout();
+    for (auto i = 0; i < 40; i++) {
+        layout->keymap_id++;
+        kbd::x11_save_layout_snapshot(*layout);
+    }
+    ASSERT_EQ(16, snapshot_files_count());
+
+    ASSERT_TRUE(kbd::x11_load_layout_snapshot(layout->keymap_id, 0));
+}
+
+} // namespace keyboard_auto_type_test